@@ -0,0 +1,369 @@
+/*
+ * ESFMu: emulator for the ESS "ESFM" enhanced OPL3 clone
+ * Copyright (C) 2023 Kagamiin~
+ *
+ * ESFMu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * ESFMu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ESFMu. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Rendering speed benchmark, run over a few representative workloads.
+ *
+ * Build it together with the emulator, once as is and once with the
+ * C fallback forced, to compare the two feedback kernels:
+ *
+ *     cc -O2 -I. -o esfm_bench bench/esfm_bench.c esfm.c esfm_registers.c
+ *     cc -O2 -I. -D_ESFMU_DISABLE_ASM_OPTIMIZATIONS -o esfm_bench_c \
+ *         bench/esfm_bench.c esfm.c esfm_registers.c
+ *
+ * Building with -D_ESFMU_ENABLE_STATS (and -D_ESFMU_ENABLE_STATS_TIMING)
+ * also prints the emulator's own statistics for each workload, and building
+ * with -D_ESFMU_SMALL_TABLES measures the reduced waveform table mode.
+ *
+ * Usage: esfm_bench [seconds per workload] [workload name]
+ */
+
+#include "esfm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BENCH_BLOCK_SIZE 4096
+#define BENCH_WRITE_INTERVAL 64
+
+typedef struct _bench_workload
+{
+	const char *name;
+	const char *description;
+	void (*setup)(esfm_chip *chip);
+	// Writes registers every BENCH_WRITE_INTERVAL samples, or NULL
+	void (*update)(esfm_chip *chip, uint32_t interval_idx);
+
+} bench_workload;
+
+static const uint8_t emu_slot_offsets[9] = {
+	0x00, 0x01, 0x02, 0x08, 0x09, 0x0a, 0x10, 0x11, 0x12
+};
+
+static int16_t bench_buf[BENCH_BLOCK_SIZE * 2];
+
+/* ------------------------------------------------------------------------- */
+static void
+bench_emu_patch(esfm_chip *chip, uint16_t bank, int channel_idx, uint8_t feedback)
+{
+	uint16_t slot = bank | emu_slot_offsets[channel_idx];
+
+	ESFM_write_reg(chip, slot + 0x20, 0x21);
+	ESFM_write_reg(chip, slot + 0x23, 0x21);
+	ESFM_write_reg(chip, slot + 0x40, 0x10);
+	ESFM_write_reg(chip, slot + 0x43, 0x00);
+	ESFM_write_reg(chip, slot + 0x60, 0xf2);
+	ESFM_write_reg(chip, slot + 0x63, 0xf2);
+	ESFM_write_reg(chip, slot + 0x80, 0x24);
+	ESFM_write_reg(chip, slot + 0x83, 0x24);
+	ESFM_write_reg(chip, bank | (0xc0 + channel_idx), 0x30 | (feedback << 1));
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+bench_emu_set_freq(esfm_chip *chip, uint16_t bank, int channel_idx, uint16_t f_num, uint8_t key_on)
+{
+	ESFM_write_reg(chip, bank | (0xa0 + channel_idx), f_num & 0xff);
+	ESFM_write_reg(chip, bank | (0xb0 + channel_idx), (key_on << 5) | (4 << 2) | (f_num >> 8));
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+bench_setup_idle(esfm_chip *chip)
+{
+	ESFM_write_reg(chip, 0x105, 0x01);
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+bench_setup_native_4op(esfm_chip *chip)
+{
+	int channel_idx, slot_idx;
+
+	ESFM_write_reg(chip, 0x105, 0x80);
+	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	{
+		for (slot_idx = 0; slot_idx < 4; slot_idx++)
+		{
+			uint16_t base = channel_idx * 32 + slot_idx * 8;
+			ESFM_write_reg(chip, base + 0, 0x21);
+			ESFM_write_reg(chip, base + 1, 0x10);
+			ESFM_write_reg(chip, base + 2, 0xf2);
+			ESFM_write_reg(chip, base + 3, 0x24);
+			ESFM_write_reg(chip, base + 4, 0x40 + channel_idx * 5);
+			ESFM_write_reg(chip, base + 5, 0x11);
+			// Maximum feedback / modulation, both outputs
+			ESFM_write_reg(chip, base + 6, 0x3e);
+			ESFM_write_reg(chip, base + 7, 0x81 + slot_idx);
+		}
+	}
+	for (channel_idx = 0; channel_idx < 16; channel_idx++)
+	{
+		ESFM_write_reg(chip, 0x240 + channel_idx, 0x01);
+	}
+	ESFM_write_reg(chip, 0x250, 0x01);
+	ESFM_write_reg(chip, 0x251, 0x01);
+	ESFM_write_reg(chip, 0x252, 0x01);
+	ESFM_write_reg(chip, 0x253, 0x01);
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+bench_setup_native_noise3(esfm_chip *chip)
+{
+	int channel_idx;
+
+	bench_setup_native_4op(chip);
+	// Slot 3 of every channel in noise mode 3
+	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	{
+		ESFM_write_reg(chip, channel_idx * 32 + 3 * 8 + 7, 0x84 | (3 << 3));
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+bench_setup_emu_18ch(esfm_chip *chip)
+{
+	int channel_idx, bank;
+
+	ESFM_write_reg(chip, 0x105, 0x01);
+	for (bank = 0; bank < 2; bank++)
+	{
+		for (channel_idx = 0; channel_idx < 9; channel_idx++)
+		{
+			bench_emu_patch(chip, bank << 8, channel_idx, 7);
+			bench_emu_set_freq(chip, bank << 8, channel_idx, 0x200 + channel_idx * 24, 1);
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+bench_setup_emu_rhythm(esfm_chip *chip)
+{
+	int channel_idx, bank;
+
+	ESFM_write_reg(chip, 0x105, 0x01);
+	ESFM_write_reg(chip, 0x104, 0x03);
+	for (bank = 0; bank < 2; bank++)
+	{
+		for (channel_idx = 0; channel_idx < 9; channel_idx++)
+		{
+			bench_emu_patch(chip, bank << 8, channel_idx, 5);
+			// Bank 0 channels 6-8 are the rhythm section, keyed through 0xbd
+			bench_emu_set_freq(chip, bank << 8, channel_idx, 0x200 + channel_idx * 24,
+				bank == 1 || channel_idx < 6);
+		}
+	}
+	ESFM_write_reg(chip, 0xbd, 0xe0);
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+bench_setup_native_4op_preview(esfm_chip *chip)
+{
+	bench_setup_native_4op(chip);
+	ESFM_set_preview(chip, 4, 4, 1);
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+bench_setup_emu_18ch_preview(esfm_chip *chip)
+{
+	bench_setup_emu_18ch(chip);
+	ESFM_set_preview(chip, 4, 4, 1);
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+bench_update_emu_rhythm(esfm_chip *chip, uint32_t interval_idx)
+{
+	// A drum hit every 64 intervals (about 80 ms)
+	if ((interval_idx & 0x3f) == 0)
+	{
+		ESFM_write_reg_buffered_fast(chip, 0xbd, 0xe0);
+		ESFM_write_reg_buffered_fast(chip, 0xbd, 0xe0 | (0x1f >> (interval_idx >> 6 & 0x03)));
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+bench_update_write_heavy(esfm_chip *chip, uint32_t interval_idx)
+{
+	// Pitch slides on every channel
+	int channel_idx, bank;
+	for (bank = 0; bank < 2; bank++)
+	{
+		for (channel_idx = 0; channel_idx < 9; channel_idx++)
+		{
+			uint16_t f_num = 0x200 + ((interval_idx + channel_idx * 16) & 0xff);
+			ESFM_write_reg_buffered_fast(chip, (bank << 8) | (0xa0 + channel_idx), f_num & 0xff);
+			ESFM_write_reg_buffered_fast(chip, (bank << 8) | (0xb0 + channel_idx),
+				0x20 | (4 << 2) | (f_num >> 8));
+		}
+	}
+}
+
+static const bench_workload bench_workloads[] = {
+	{ "idle", "all channels idle", bench_setup_idle, NULL },
+	{ "native-4op", "18 native 4-op voices, heavy feedback", bench_setup_native_4op, NULL },
+	{ "native-noise", "native-4op with slot 3 in noise mode 3", bench_setup_native_noise3, NULL },
+	{ "emu-18ch", "OPL3 mode, 18 2-op voices with feedback", bench_setup_emu_18ch, NULL },
+	{ "emu-rhythm", "OPL3 mode, 4-op voices and rhythm section", bench_setup_emu_rhythm,
+		bench_update_emu_rhythm },
+	{ "write-heavy", "OPL3 mode, 36 buffered writes every 64 samples", bench_setup_emu_18ch,
+		bench_update_write_heavy },
+	// Approximate rendering: 4 feedback iterations, envelopes every 4 samples
+	{ "preview-4op", "native-4op in preview mode", bench_setup_native_4op_preview, NULL },
+	{ "preview-18ch", "emu-18ch in preview mode", bench_setup_emu_18ch_preview, NULL },
+};
+
+/* ------------------------------------------------------------------------- */
+static const char *
+bench_feedback_kernel(void)
+{
+	// Mirrors the selection in esfm.c
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) \
+	&& !defined(_ESFMU_DISABLE_ASM_OPTIMIZATIONS)
+	return __builtin_cpu_supports("avx2") ? "AVX2" : "C (no AVX2 on this CPU)";
+#else
+	return "C";
+#endif
+}
+
+#ifdef _ESFMU_ENABLE_STATS
+/* ------------------------------------------------------------------------- */
+static void
+bench_print_stats(const esfm_stats *stats)
+{
+	static const char *stage_names[ESFM_NUM_STAGES] = {
+		"envelope", "phase", "slot output", "feedback", "write buffer"
+	};
+	uint64_t total_cycles = 0;
+	int stage;
+
+	printf("    %.1f active slots, %.1f feedback chains per sample; write queue peak %lu,"
+		" %llu + %llu deferred writes\n",
+		(double)stats->active_slots / stats->samples,
+		(double)stats->feedback_chains / stats->samples,
+		(unsigned long)stats->write_buf_high_water,
+		(unsigned long long)stats->deferred_key_on_writes,
+		(unsigned long long)stats->deferred_bassdrum_writes);
+	for (stage = 0; stage < ESFM_NUM_STAGES; stage++)
+	{
+		total_cycles += stats->stage_cycles[stage];
+	}
+	if (total_cycles == 0)
+	{
+		return;
+	}
+	printf("   ");
+	for (stage = 0; stage < ESFM_NUM_STAGES; stage++)
+	{
+		printf(" %s %.1f%%", stage_names[stage], stats->stage_cycles[stage] * 100.0 / total_cycles);
+	}
+	printf("\n");
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+static void
+bench_run(esfm_chip_with_write_buf *chip_storage, const bench_workload *workload, double seconds)
+{
+	esfm_chip *chip = &chip_storage->chip;
+	clock_t start, deadline;
+	uint64_t num_samples = 0;
+	uint32_t interval_idx = 0;
+	double elapsed;
+
+	ESFM_init(chip_storage);
+	workload->setup(chip);
+	// Get past the attack phase
+	ESFM_generate_stream(chip, bench_buf, BENCH_BLOCK_SIZE);
+#ifdef _ESFMU_ENABLE_STATS
+	ESFM_reset_stats(chip);
+#endif
+
+	start = clock();
+	deadline = start + (clock_t)(seconds * CLOCKS_PER_SEC);
+	do
+	{
+		if (workload->update != NULL)
+		{
+			int i;
+			for (i = 0; i < BENCH_BLOCK_SIZE / BENCH_WRITE_INTERVAL; i++)
+			{
+				workload->update(chip, interval_idx++);
+				ESFM_generate_stream(chip, &bench_buf[i * BENCH_WRITE_INTERVAL * 2],
+					BENCH_WRITE_INTERVAL);
+			}
+		}
+		else
+		{
+			ESFM_generate_stream(chip, bench_buf, BENCH_BLOCK_SIZE);
+		}
+		num_samples += BENCH_BLOCK_SIZE;
+	}
+	while (clock() < deadline);
+	elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	printf("%-12s %12.0f %10.1f %9.1fx   %s\n", workload->name, num_samples / elapsed,
+		elapsed * 1e9 / num_samples, num_samples / elapsed / ESFM_SAMPLE_RATE,
+		workload->description);
+#ifdef _ESFMU_ENABLE_STATS
+	bench_print_stats(&chip->stats);
+#endif
+}
+
+/* ------------------------------------------------------------------------- */
+int
+main(int argc, char **argv)
+{
+	static esfm_chip_with_write_buf chip;
+	double seconds = 2.0;
+	const char *only = NULL;
+	size_t i;
+
+	if (argc > 1)
+	{
+		seconds = atof(argv[1]);
+		if (seconds <= 0.0)
+		{
+			fprintf(stderr, "usage: %s [seconds per workload] [workload name]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (argc > 2)
+	{
+		only = argv[2];
+	}
+
+	printf("Feedback kernel: %s\n\n", bench_feedback_kernel());
+	printf("%-12s %12s %10s %10s\n", "workload", "samples/s", "ns/sample", "realtime");
+	for (i = 0; i < sizeof(bench_workloads) / sizeof(bench_workloads[0]); i++)
+	{
+		if (only == NULL || strcmp(only, bench_workloads[i].name) == 0)
+		{
+			bench_run(&chip, &bench_workloads[i], seconds);
+		}
+	}
+	return 0;
+}
@@ -59,6 +59,55 @@
 #include <string.h>
 #include <stdbool.h>
 
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) \
+	&& !defined(_ESFMU_DISABLE_ASM_OPTIMIZATIONS)
+#define ESFM_FEEDBACK_AVX2
+#include <immintrin.h>
+#endif
+
+// Used on the functions that get specialized for each chip mode through
+// their constant arguments, so that they're always inlined into the kernels
+#if defined(__GNUC__) || defined(__clang__)
+#define ESFM_FORCE_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define ESFM_FORCE_INLINE __forceinline
+#else
+#define ESFM_FORCE_INLINE inline
+#endif
+
+// Instrumentation hooks; without _ESFMU_ENABLE_STATS they compile to nothing.
+// Stage timers measure the time since they were started or last lapped.
+#ifdef _ESFMU_ENABLE_STATS
+#define ESFM_STATS_ADD(chip, field, value) ((chip)->stats.field += (value))
+#else
+#define ESFM_STATS_ADD(chip, field, value) ((void)0)
+#endif
+
+#if defined(_ESFMU_ENABLE_STATS) && defined(_ESFMU_ENABLE_STATS_TIMING)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define ESFM_STATS_CLOCK() __rdtsc()
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define ESFM_STATS_CLOCK() __rdtsc()
+#else
+#include <time.h>
+#define ESFM_STATS_CLOCK() ((uint64_t)clock())
+#endif
+#define ESFM_STATS_TIMER(timer) uint64_t timer = ESFM_STATS_CLOCK()
+#define ESFM_STATS_LAP(chip, timer, stage) \
+	do \
+	{ \
+		uint64_t stats_now = ESFM_STATS_CLOCK(); \
+		(chip)->stats.stage_cycles[stage] += stats_now - (timer); \
+		(timer) = stats_now; \
+	} while (0)
+#else
+#define ESFM_STATS_TIMER(timer)
+#define ESFM_STATS_LAP(chip, timer, stage) ((void)(chip))
+#endif
+
+#ifndef _ESFMU_SMALL_TABLES
 /*
  * Log-scale quarter sine table extracted from OPL3 ROM; taken straight from
  * Nuked OPL3 source code.
@@ -67,8 +116,10 @@
  * waves using some sort of boolean logic wizardry (lol)
  * Optimization: All 8 waveforms are calculated and unfolded from the actual
  * data in OPL3's ROM. Negative entries are marked by 0x8000.
+ * The extra zero entry at the end keeps 32-bit SIMD gathers of the last
+ * entry within bounds.
  */
-static const uint16_t logsinrom[1024*8] = {
+static const uint16_t logsinrom[1024*8 + 1] = {
 	// wave 0
 	0x0859, 0x06c3, 0x0607, 0x058b, 0x052e, 0x04e4, 0x04a6, 0x0471, 
 	0x0443, 0x041a, 0x03f5, 0x03d3, 0x03b5, 0x0398, 0x037e, 0x0365, 
@@ -1102,6 +1153,80 @@ static const uint16_t logsinrom[1024*8] = {
 	0x8078, 0x8070, 0x8068, 0x8060, 0x8058, 0x8050, 0x8048, 0x8040, 
 	0x8038, 0x8030, 0x8028, 0x8020, 0x8018, 0x8010, 0x8008, 0x8000,
 };
+#else
+/*
+ * Log-scale quarter sine table extracted from OPL3 ROM; taken straight from
+ * Nuked OPL3 source code. With _ESFMU_SMALL_TABLES, the 8 waveforms are
+ * derived from it on each lookup instead of being stored unfolded, trading a
+ * few instructions for a 16x smaller table.
+ * The extra zero entry at the end keeps 32-bit SIMD gathers of the last
+ * entry within bounds.
+ */
+static const uint16_t logsinrom[256 + 1] = {
+	0x0859, 0x06c3, 0x0607, 0x058b, 0x052e, 0x04e4, 0x04a6, 0x0471,
+	0x0443, 0x041a, 0x03f5, 0x03d3, 0x03b5, 0x0398, 0x037e, 0x0365,
+	0x034e, 0x0339, 0x0324, 0x0311, 0x02ff, 0x02ed, 0x02dc, 0x02cd,
+	0x02bd, 0x02af, 0x02a0, 0x0293, 0x0286, 0x0279, 0x026d, 0x0261,
+	0x0256, 0x024b, 0x0240, 0x0236, 0x022c, 0x0222, 0x0218, 0x020f,
+	0x0206, 0x01fd, 0x01f5, 0x01ec, 0x01e4, 0x01dc, 0x01d4, 0x01cd,
+	0x01c5, 0x01be, 0x01b7, 0x01b0, 0x01a9, 0x01a2, 0x019b, 0x0195,
+	0x018f, 0x0188, 0x0182, 0x017c, 0x0177, 0x0171, 0x016b, 0x0166,
+	0x0160, 0x015b, 0x0155, 0x0150, 0x014b, 0x0146, 0x0141, 0x013c,
+	0x0137, 0x0133, 0x012e, 0x0129, 0x0125, 0x0121, 0x011c, 0x0118,
+	0x0114, 0x010f, 0x010b, 0x0107, 0x0103, 0x00ff, 0x00fb, 0x00f8,
+	0x00f4, 0x00f0, 0x00ec, 0x00e9, 0x00e5, 0x00e2, 0x00de, 0x00db,
+	0x00d7, 0x00d4, 0x00d1, 0x00cd, 0x00ca, 0x00c7, 0x00c4, 0x00c1,
+	0x00be, 0x00bb, 0x00b8, 0x00b5, 0x00b2, 0x00af, 0x00ac, 0x00a9,
+	0x00a7, 0x00a4, 0x00a1, 0x009f, 0x009c, 0x0099, 0x0097, 0x0094,
+	0x0092, 0x008f, 0x008d, 0x008a, 0x0088, 0x0086, 0x0083, 0x0081,
+	0x007f, 0x007d, 0x007a, 0x0078, 0x0076, 0x0074, 0x0072, 0x0070,
+	0x006e, 0x006c, 0x006a, 0x0068, 0x0066, 0x0064, 0x0062, 0x0060,
+	0x005e, 0x005c, 0x005b, 0x0059, 0x0057, 0x0055, 0x0053, 0x0052,
+	0x0050, 0x004e, 0x004d, 0x004b, 0x004a, 0x0048, 0x0046, 0x0045,
+	0x0043, 0x0042, 0x0040, 0x003f, 0x003e, 0x003c, 0x003b, 0x0039,
+	0x0038, 0x0037, 0x0035, 0x0034, 0x0033, 0x0031, 0x0030, 0x002f,
+	0x002e, 0x002d, 0x002b, 0x002a, 0x0029, 0x0028, 0x0027, 0x0026,
+	0x0025, 0x0024, 0x0023, 0x0022, 0x0021, 0x0020, 0x001f, 0x001e,
+	0x001d, 0x001c, 0x001b, 0x001a, 0x0019, 0x0018, 0x0017, 0x0017,
+	0x0016, 0x0015, 0x0014, 0x0014, 0x0013, 0x0012, 0x0011, 0x0011,
+	0x0010, 0x000f, 0x000f, 0x000e, 0x000d, 0x000d, 0x000c, 0x000c,
+	0x000b, 0x000a, 0x000a, 0x0009, 0x0009, 0x0008, 0x0008, 0x0007,
+	0x0007, 0x0007, 0x0006, 0x0006, 0x0005, 0x0005, 0x0005, 0x0004,
+	0x0004, 0x0004, 0x0003, 0x0003, 0x0003, 0x0002, 0x0002, 0x0002,
+	0x0002, 0x0001, 0x0001, 0x0001, 0x0001, 0x0001, 0x0001, 0x0001,
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0000
+};
+
+/*
+ * How each waveform is derived from the quarter sine, by phase bits 9-0:
+ * the phase gets shifted left (doubling the frequency of waveforms 4 and 5),
+ * mirrored (the quarter index XORed with mirror) wherever bit 8 of the
+ * shifted phase is set, silenced wherever silent_mask matches and negated
+ * wherever sign_mask matches. Waveforms 6 and 7 don't use the table: the
+ * log-saw is computed from the phase, and the square wave is the same with
+ * saw_mask clearing the level.
+ */
+static const struct
+{
+	// Laid out by field, so that SIMD code can look up 8 waveforms at once
+	int32_t shift[8];
+	int32_t mirror[8];
+	int32_t silent_mask[8];
+	int32_t sign_mask[8];
+	int32_t saw_mask[8];
+	int32_t saw[8];
+} waveform_folds = {
+	// sine, half sine, absolute sine, pulse sine, alternating sine,
+	// camel sine, square, log-saw
+	{ 0, 0, 0, 0, 1, 1, 0, 0 },
+	{ 0xff, 0xff, 0xff, 0x00, 0xfe, 0xfe, 0x00, 0x00 },
+	{ 0x000, 0x200, 0x000, 0x100, 0x200, 0x200, 0x000, 0x000 },
+	{ 0x200, 0x000, 0x000, 0x000, 0x100, 0x000, 0x200, 0x200 },
+	{ 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0xffff },
+	{ 0, 0, 0, 0, 0, 0, -1, -1 }
+};
+#endif
 
 /*
  * Inverse exponent table extracted from OPL3 ROM; taken straight from
@@ -1110,8 +1235,9 @@ static const uint16_t logsinrom[1024*8] = {
  * method to skirt around Yamaha's patents?
  * Optimization: All entries are shifted left by one from the actual data in
  * OPL3's ROM.
+ * The extra zero entry at the end serves the same purpose as in logsinrom.
  */
-static const uint16_t exprom[256] = {
+static const uint16_t exprom[256 + 1] = {
 	0xff4, 0xfea, 0xfde, 0xfd4, 0xfc8, 0xfbe, 0xfb4, 0xfa8,
 	0xf9e, 0xf92, 0xf88, 0xf7e, 0xf72, 0xf68, 0xf5c, 0xf52,
 	0xf48, 0xf3e, 0xf32, 0xf28, 0xf1e, 0xf14, 0xf08, 0xefe,
@@ -1184,12 +1310,84 @@ static const uint8_t eg_incstep[4][4] = {
 	{ 1, 1, 1, 0 }
 };
 
+/*
+ * Per-block synthesis setup. Everything in here depends only on register
+ * state, so it's computed once at the start of each run of samples in which
+ * no register writes happen, instead of once per sample.
+ */
+typedef struct _esfm_feedback_setup
+{
+	esfm_slot *slot;
+	uint32 phase_offset;
+	uint3 waveform;
+	uint3 mod_in_shift;
+	uint3 out_shift;
+
+} esfm_feedback_setup;
+
+typedef struct _esfm_block_state
+{
+	esfm_feedback_setup feedback[18];
+	int num_feedback;
+	// Emulation mode only
+	uint3 emu_waveform_mask;
+	flag emu_rhythm_mode;
+	// Key-on flag followed by slots 0 and 1 of each channel, which can come
+	// from the other channel of a 4-op pair
+	const flag *emu_key_on[18 * 2];
+	// Host CPU supports the AVX2 feedback kernel
+	flag feedback_avx2;
+	// 29, or fewer in preview mode
+	uint8 feedback_iterations;
+
+	// Native mode only: slots with rhythm noise enabled, in slot order
+	esfm_slot *rhythm_slots[18];
+	int num_rhythm_slots;
+
+} esfm_block_state;
+
+/*
+ * Envelope attenuation level at or above which ESFM_envelope_wavegen always
+ * outputs zero, no matter the waveform or phase (since the exponent table
+ * entries are all below 0x1000).
+ */
+#define ESFM_EG_SILENT_LEVEL 0x180
+
+/* ------------------------------------------------------------------------- */
+static inline uint16
+ESFM_logsin_lookup(uint3 waveform, uint10 phase)
+{
+	// Log-sine entry of the waveform, with 0x8000 marking negative values
+#ifndef _ESFMU_SMALL_TABLES
+	return logsinrom[((uint16)waveform << 10) | phase];
+#else
+	uint16 sign = (phase & waveform_folds.sign_mask[waveform]) ? 0x8000 : 0;
+	uint16 folded;
+
+	if (phase & waveform_folds.silent_mask[waveform])
+	{
+		return 0x1000;
+	}
+	if (waveform_folds.saw[waveform])
+	{
+		return sign | ((((phase & 0x1ff) ^ (sign ? 0x1ff : 0)) << 3)
+			& waveform_folds.saw_mask[waveform]);
+	}
+	folded = phase << waveform_folds.shift[waveform];
+	if (folded & 0x100)
+	{
+		folded ^= waveform_folds.mirror[waveform];
+	}
+	return sign | logsinrom[folded & 0xff];
+#endif
+}
+
 /* ------------------------------------------------------------------------- */
 static inline int13
 ESFM_envelope_wavegen(uint3 waveform, int16 phase, uint10 envelope)
 {
 	int13 out;
-	uint16 lookup = logsinrom[((uint16)waveform << 10) | (phase & 0x3ff)];
+	uint16 lookup = ESFM_logsin_lookup(waveform, phase & 0x3ff);
 	uint16 level = (lookup & 0x1fff) + (envelope << 3);
 	if (level > 0x1fff)
 	{
@@ -1204,8 +1402,32 @@ ESFM_envelope_wavegen(uint3 waveform, int16 phase, uint10 envelope)
 }
 
 /* ------------------------------------------------------------------------- */
-static void
-ESFM_envelope_calc(esfm_slot *slot)
+static inline void
+ESFM_envelope_update_output(esfm_slot *slot)
+{
+	esfm_slot_state *state = &slot->chip->slot_state;
+	uint7 idx = slot->state_idx;
+	state->eg_output[idx] = slot->in.eg_position + state->eg_level_offset[idx]
+		+ (slot->chip->tremolo >> state->eg_tremolo_shift[idx]);
+}
+
+/*
+ * Envelope generator timing, as seen by ESFM_envelope_calc: the chip's own
+ * timers, or in preview mode a slower clock that ticks once per update. The
+ * rates get raised by interval_shift to make up for the slower clock.
+ */
+typedef struct _esfm_eg_clock
+{
+	uint8 clocks;
+	flag tick;
+	uint2 step;
+
+} esfm_eg_clock;
+
+/* ------------------------------------------------------------------------- */
+static ESFM_FORCE_INLINE void
+ESFM_envelope_calc(esfm_slot *slot, bool key_on, const esfm_eg_clock *clock,
+	const flag native_mode, const uint8 interval_shift)
 {
 	uint8 nonzero;
 	uint8 rate;
@@ -1218,90 +1440,65 @@ ESFM_envelope_calc(esfm_slot *slot)
 	uint9 eg_rout;
 	int16 eg_inc;
 	bool reset = 0;
-	bool key_on;
 	bool key_on_signal;
+	bool delay_elapsed;
 
-	key_on = *slot->in.key_on;
-	if (!slot->chip->native_mode)
-	{
-		int pair_primary_idx = emu_4op_secondary_to_primary[slot->channel->channel_idx];
-		if (pair_primary_idx >= 0)
-		{
-			esfm_channel *pair_primary = &slot->channel->chip->channels[pair_primary_idx];
-			if (pair_primary->emu_mode_4op_enable)
-			{
-				key_on = *pair_primary->slots[0].in.key_on;
-			}
-		}
-		else if ((slot->channel->channel_idx == 7 || slot->channel->channel_idx == 8)
-			&& slot->slot_idx == 1)
-		{
-			key_on = slot->channel->key_on_2;
-		}
-	}
-
-	slot->in.eg_output = slot->in.eg_position + (slot->t_level << 2)
-		+ (slot->in.eg_ksl_offset >> kslshift[slot->ksl]);
-	if (slot->tremolo_en)
-	{
-		uint8 tremolo;
-		if (slot->chip->native_mode)
-		{
-			tremolo = slot->channel->chip->tremolo >> ((!slot->tremolo_deep << 1) + 2);
-		}
-		else
-		{
-			tremolo = slot->channel->chip->tremolo >> ((!slot->chip->emu_tremolo_deep << 1) + 2);
-		}
-		slot->in.eg_output += tremolo;
-	}
+	ESFM_envelope_update_output(slot);
 	
-	if (slot->in.eg_delay_run && slot->in.eg_delay_counter < 32768)
+#ifndef _ESFMU_EMU_ONLY
+	if (slot->in.eg_delay.run && slot->in.eg_delay.counter < 32768)
 	{
-		slot->in.eg_delay_counter++;
+		slot->in.eg_delay.counter += 1 << interval_shift;
 	}
 	
 	// triggers on key-on edge
 	if (key_on && !slot->in.key_on_gate)
 	{
-		slot->in.eg_delay_run = 1;
-		slot->in.eg_delay_counter = 0;
-		slot->in.eg_delay_transitioned_01 = 0;
-		slot->in.eg_delay_transitioned_01_gate = 0;
-		slot->in.eg_delay_transitioned_10 = 0;
-		slot->in.eg_delay_transitioned_10_gate = 0;
-		slot->in.eg_delay_counter_compare = 0;
+		slot->in.eg_delay.run = 1;
+		slot->in.eg_delay.counter = 0;
+		slot->in.eg_delay.transitioned_01 = 0;
+		slot->in.eg_delay.transitioned_01_gate = 0;
+		slot->in.eg_delay.transitioned_10 = 0;
+		slot->in.eg_delay.transitioned_10_gate = 0;
+		slot->in.eg_delay.counter_compare = 0;
 		if (slot->env_delay > 0)
 		{
-			slot->in.eg_delay_counter_compare = 256 << slot->env_delay;
+			slot->in.eg_delay.counter_compare = 256 << slot->env_delay;
 		}
 	}
 	else if (!key_on)
 	{
-		slot->in.eg_delay_run = 0;
+		slot->in.eg_delay.run = 0;
 	}
 	
 	// TODO: is this really how the chip behaves? Can it only transition the envelope delay once? Am I implementing this in a sane way? I feel like this is a roundabout hack.
-	if ((slot->in.eg_delay_transitioned_10 && !slot->in.eg_delay_transitioned_10_gate) ||
-		(slot->in.eg_delay_transitioned_01 && !slot->in.eg_delay_transitioned_01_gate)
+	if ((slot->in.eg_delay.transitioned_10 && !slot->in.eg_delay.transitioned_10_gate) ||
+		(slot->in.eg_delay.transitioned_01 && !slot->in.eg_delay.transitioned_01_gate)
 	)
 	{
-		slot->in.eg_delay_counter_compare = 0;
+		slot->in.eg_delay.counter_compare = 0;
 		if (slot->env_delay > 0)
 		{
-			slot->in.eg_delay_counter_compare = 256 << slot->env_delay;
+			slot->in.eg_delay.counter_compare = 256 << slot->env_delay;
 		}
-		if (slot->in.eg_delay_transitioned_10)
+		if (slot->in.eg_delay.transitioned_10)
 		{
-			slot->in.eg_delay_transitioned_10_gate = 1;
+			slot->in.eg_delay.transitioned_10_gate = 1;
 		}
-		if (slot->in.eg_delay_transitioned_01)
+		if (slot->in.eg_delay.transitioned_01)
 		{
-			slot->in.eg_delay_transitioned_01_gate = 1;
+			slot->in.eg_delay.transitioned_01_gate = 1;
 		}
 	}
 	
-	if (key_on && ((slot->in.eg_delay_counter >= slot->in.eg_delay_counter_compare) || !slot->chip->native_mode))
+	delay_elapsed = (slot->in.eg_delay.counter >= slot->in.eg_delay.counter_compare) || !native_mode;
+#else
+	// Envelope delays only exist in native mode
+	(void)native_mode;
+	delay_elapsed = 1;
+#endif
+	
+	if (key_on && delay_elapsed)
 	{
 		key_on_signal = 1;
 	} else {
@@ -1311,7 +1508,7 @@ ESFM_envelope_calc(esfm_slot *slot)
 	if (key_on && slot->in.eg_state == EG_RELEASE)
 	{
 
-		if ((slot->in.eg_delay_counter >= slot->in.eg_delay_counter_compare) || !slot->chip->native_mode)
+		if (delay_elapsed)
 		{
 			reset = 1;
 			reg_rate = slot->attack_rate;
@@ -1343,23 +1540,23 @@ ESFM_envelope_calc(esfm_slot *slot)
 		}
 	}
 	slot->in.key_on_gate = key_on;
-	slot->in.phase_reset = reset;
-	ks = slot->in.keyscale >> ((!slot->ksr) << 1);
+	slot->chip->slot_state.phase_reset[slot->state_idx] = reset;
+	ks = slot->chip->slot_state.eg_rate_keyscale[slot->state_idx];
 	nonzero = (reg_rate != 0);
 	rate = ks + (reg_rate << 2);
-	rate_hi = rate >> 2;
+	rate_hi = (rate >> 2) + interval_shift;
 	rate_lo = rate & 0x03;
 	if (rate_hi & 0x10)
 	{
 		rate_hi = 0x0f;
 	}
-	eg_shift = rate_hi + slot->chip->eg_clocks;
+	eg_shift = rate_hi + clock->clocks;
 	shift = 0;
 	if (nonzero)
 	{
 		if (rate_hi < 12)
 		{
-			if (slot->chip->eg_tick)
+			if (clock->tick)
 			{
 				switch (eg_shift)
 				{
@@ -1380,14 +1577,14 @@ ESFM_envelope_calc(esfm_slot *slot)
 		else
 		{
 			shift = (rate_hi & 0x03)
-				+ eg_incstep[rate_lo][slot->chip->global_timer & 0x03];
+				+ eg_incstep[rate_lo][clock->step];
 			if (shift & 0x04)
 			{
 				shift = 0x03;
 			}
 			if (!shift)
 			{
-				shift = slot->chip->eg_tick;
+				shift = clock->tick;
 			}
 		}
 	}
@@ -1448,22 +1645,20 @@ ESFM_envelope_calc(esfm_slot *slot)
 	{
 		slot->in.eg_state = EG_RELEASE;
 	}
+	/* Envelope fully released; nothing changes until the next key-on */
+	if (!key_on && slot->in.eg_state == EG_RELEASE && slot->in.eg_position == 0x1ff)
+	{
+		slot->channel->slots_active &= ~(1 << slot->slot_idx);
+	}
 }
 
 /* ------------------------------------------------------------------------- */
-static void
-ESFM_phase_generate(esfm_slot *slot)
+static uint32
+ESFM_phase_increment(const esfm_chip *chip, uint10 f_num, uint3 block, uint4 mult,
+	flag vibrato_en, flag vibrato_deep)
 {
-	esfm_chip *chip;
-	uint10 f_num;
 	uint32 basefreq;
-	bool rm_xor, n_bit;
-	uint23 noise;
-	uint10 phase;
-
-	chip = slot->chip;
-	f_num = slot->f_num;
-	if (slot->vibrato_en)
+	if (vibrato_en)
 	{
 		int8_t range;
 		uint8_t vibpos;
@@ -1479,7 +1674,7 @@ ESFM_phase_generate(esfm_slot *slot)
 		{
 			range >>= 1;
 		}
-		range >>= !slot->vibrato_deep;
+		range >>= !vibrato_deep;
 
 		if (vibpos & 4)
 		{
@@ -1487,228 +1682,302 @@ ESFM_phase_generate(esfm_slot *slot)
 		}
 		f_num += range;
 	}
-	basefreq = (f_num << slot->block) >> 1;
-	phase = (uint10)(slot->in.phase_acc >> 9);
-	if (slot->in.phase_reset)
+	basefreq = (f_num << block) >> 1;
+	return (basefreq * mt[mult]) >> 1;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_update_slot_phase_increment(esfm_chip *chip, esfm_slot *slot)
+{
+	esfm_slot_state *state = &chip->slot_state;
+
+	if (ESFM_NATIVE_MODE(chip))
 	{
-		slot->in.phase_acc = 0;
+		state->phase_inc[slot->state_idx] = ESFM_phase_increment(chip,
+			slot->f_num, slot->block, slot->mult, slot->vibrato_en, slot->vibrato_deep);
 	}
-	slot->in.phase_acc += (basefreq * mt[slot->mult]) >> 1;
-	slot->in.phase_acc &= (1 << 19) - 1;
-	slot->in.phase_out = phase;
-	/* Noise mode (rhythm) sounds */
-	noise = chip->lfsr;
-	if (slot->slot_idx == 3 && slot->rhy_noise)
+	else if (slot->slot_idx < 2)
 	{
-		esfm_slot *prev_slot = &slot->channel->slots[2];
-
-		chip->rm_hh_bit2 = (phase >> 2) & 1;
-		chip->rm_hh_bit3 = (phase >> 3) & 1;
-		chip->rm_hh_bit7 = (phase >> 7) & 1;
-		chip->rm_hh_bit8 = (phase >> 8) & 1;
+		esfm_channel *channel = slot->channel;
+		uint3 block = channel->slots[0].block;
+		uint10 f_num = channel->slots[0].f_num;
+		int pair_primary_idx = emu_4op_secondary_to_primary[channel->channel_idx];
+		if (pair_primary_idx >= 0)
+		{
+			esfm_channel *pair_primary = &chip->channels[pair_primary_idx];
+			if (pair_primary->emu_mode_4op_enable)
+			{
+				block = pair_primary->slots[0].block;
+				f_num = pair_primary->slots[0].f_num;
+			}
+		}
 
-		chip->rm_tc_bit3 = (prev_slot->in.phase_out >> 3) & 1;
-		chip->rm_tc_bit5 = (prev_slot->in.phase_out >> 5) & 1;
+		state->phase_inc[slot->state_idx] = ESFM_phase_increment(chip,
+			f_num, block, slot->mult, slot->vibrato_en, chip->emu_vibrato_deep);
+	}
+}
 
-		rm_xor = (chip->rm_hh_bit2 ^ chip->rm_hh_bit7)
-			   | (chip->rm_hh_bit3 ^ chip->rm_tc_bit5)
-			   | (chip->rm_tc_bit3 ^ chip->rm_tc_bit5);
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_update_phase_increments(esfm_chip *chip)
+{
+	int channel_idx, slot_idx;
 
-		switch(slot->rhy_noise)
+	chip->phase_inc_vibrato_pos = chip->vibrato_pos;
+	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	{
+		for (slot_idx = 0; slot_idx < ESFM_CHANNEL_SLOTS; slot_idx++)
 		{
-			case 1:
-				// SD
-				slot->in.phase_out = (chip->rm_hh_bit8 << 9)
-					| ((chip->rm_hh_bit8 ^ (noise & 1)) << 8);
-				break;
-			case 2:
-				// HH
-				slot->in.phase_out = rm_xor << 9;
-				if (rm_xor ^ (noise & 1))
-				{
-					slot->in.phase_out |= 0xd0;
-				}
-				else
-				{
-					slot->in.phase_out |= 0x34;
-				}
-				break;
-			case 3:
-				// TC
-				slot->in.phase_out = (rm_xor << 9) | 0x80;
-				break;
+			ESFM_update_slot_phase_increment(chip, &chip->channels[channel_idx].slots[slot_idx]);
 		}
 	}
+}
 
-	n_bit = ((noise >> 14) ^ noise) & 0x01;
-	chip->lfsr = (noise >> 1) | (n_bit << 22);
+/* ------------------------------------------------------------------------- */
+static inline void
+ESFM_phase_advance(esfm_slot_state *state, int idx)
+{
+	uint19 phase_acc = state->phase_acc[idx];
+	state->phase_out[idx] = (uint10)(phase_acc >> 9);
+	// phase_reset is 0 or 1, so this clears the accumulator when it's set
+	phase_acc &= (uint19)state->phase_reset[idx] - 1;
+	state->phase_acc[idx] = (phase_acc + state->phase_inc[idx]) & ((1 << 19) - 1);
 }
 
 /* ------------------------------------------------------------------------- */
 static void
-ESFM_phase_generate_emu(esfm_slot *slot)
+ESFM_lfsr_advance(esfm_chip *chip, uint23 *lfsr_steps, int num_slots)
 {
-	esfm_chip *chip;
-	uint3 block;
-	uint10 f_num;
-	uint32 basefreq;
-	bool rm_xor, n_bit;
-	uint23 noise;
-	uint10 phase;
-	int pair_primary_idx;
+	// The noise LFSR is clocked once per slot. Its feedback taps are 14 bits
+	// apart, so 9 clocks can be done at once without needing any of the bits
+	// they shift in; lfsr_steps[n] receives the state after 9 * n clocks.
+	uint23 lfsr = chip->lfsr;
+	int i;
+	for (i = 0; i < num_slots / 9; i++)
+	{
+		lfsr_steps[i] = lfsr;
+		lfsr = (lfsr >> 9) | (((lfsr ^ (lfsr >> 14)) & 0x1ff) << 14);
+	}
+	chip->lfsr = lfsr;
+}
 
-	chip = slot->chip;
-	block = slot->channel->slots[0].block;
-	f_num = slot->channel->slots[0].f_num;
+/* ------------------------------------------------------------------------- */
+static inline flag
+ESFM_lfsr_noise_bit(const uint23 *lfsr_steps, int idx)
+{
+	// Noise bit seen by the slot processed after idx LFSR clocks
+	return (lfsr_steps[idx / 9] >> (idx % 9)) & 1;
+}
 
-	pair_primary_idx = emu_4op_secondary_to_primary[slot->channel->channel_idx];
-	if (pair_primary_idx >= 0)
+/* ------------------------------------------------------------------------- */
+static uint23
+ESFM_lfsr_apply(const uint23 *columns, uint23 lfsr)
+{
+	// Multiplies the LFSR state by a 23x23 matrix over GF(2), given by the
+	// results for each of its bits
+	uint23 result = 0;
+	int i;
+	for (i = 0; lfsr != 0; i++, lfsr >>= 1)
 	{
-		esfm_channel *pair_primary = &slot->channel->chip->channels[pair_primary_idx];
-		if (pair_primary->emu_mode_4op_enable)
+		if (lfsr & 1)
 		{
-			block = pair_primary->slots[0].block;
-			f_num = pair_primary->slots[0].f_num;
+			result ^= columns[i];
 		}
 	}
+	return result;
+}
 
-	if (slot->vibrato_en)
-	{
-		int8_t range;
-		uint8_t vibpos;
-
-		range = (f_num >> 7) & 7;
-		vibpos = chip->vibrato_pos;
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_lfsr_jump(esfm_chip *chip, uint64_t num_samples, int num_slots)
+{
+	// Same as num_samples calls to ESFM_lfsr_advance: clocking the LFSR is
+	// linear over GF(2), so one sample's worth of clocks is a matrix, which
+	// gets raised to the num_samples'th power by squaring
+	uint23 columns[23], squared[23];
+	int i, j;
 
-		if (!(vibpos & 3))
+	for (i = 0; i < 23; i++)
+	{
+		uint23 lfsr = 1 << i;
+		for (j = 0; j < num_slots / 9; j++)
 		{
-			range = 0;
+			lfsr = (lfsr >> 9) | (((lfsr ^ (lfsr >> 14)) & 0x1ff) << 14);
 		}
-		else if (vibpos & 1)
+		columns[i] = lfsr;
+	}
+	while (num_samples > 0)
+	{
+		if (num_samples & 1)
 		{
-			range >>= 1;
+			chip->lfsr = ESFM_lfsr_apply(columns, chip->lfsr);
 		}
-		range >>= !chip->emu_vibrato_deep;
-
-		if (vibpos & 4)
+		num_samples >>= 1;
+		if (num_samples > 0)
 		{
-			range = -range;
+			for (i = 0; i < 23; i++)
+			{
+				squared[i] = ESFM_lfsr_apply(columns, columns[i]);
+			}
+			memcpy(columns, squared, sizeof(columns));
 		}
-		f_num += range;
 	}
-	basefreq = (f_num << block) >> 1;
-	phase = (uint10)(slot->in.phase_acc >> 9);
-	if (slot->in.phase_reset)
+}
+
+#ifndef _ESFMU_EMU_ONLY
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_process_phases(esfm_chip *chip, esfm_block_state *block_state)
+{
+	esfm_slot_state *state = &chip->slot_state;
+	uint23 lfsr_steps[18 * 4 / 9];
+	int idx, i;
+
+	if (chip->phase_inc_vibrato_pos != chip->vibrato_pos)
 	{
-		slot->in.phase_acc = 0;
+		ESFM_update_phase_increments(chip);
 	}
-	slot->in.phase_acc += (basefreq * mt[slot->mult]) >> 1;
-	slot->in.phase_acc &= (1 << 19) - 1;
-	slot->in.phase_out = phase;
+	for (idx = 0; idx < 18 * 4; idx++)
+	{
+		ESFM_phase_advance(state, idx);
+	}
+	ESFM_lfsr_advance(chip, lfsr_steps, 18 * 4);
 
 	/* Noise mode (rhythm) sounds */
-	noise = chip->lfsr;
-	// HH
-	if (slot->channel->channel_idx == 7 && slot->slot_idx == 0)
+	// Done in slot order, since the rm_* bits carry over from one rhythm slot
+	// to the next
+	for (i = 0; i < block_state->num_rhythm_slots; i++)
 	{
+		esfm_slot *slot = block_state->rhythm_slots[i];
+		bool rm_xor, noise;
+		uint10 phase, prev_phase_out;
+
+		idx = slot->state_idx;
+		phase = state->phase_out[idx];
+		prev_phase_out = state->phase_out[idx - 1];
+		noise = ESFM_lfsr_noise_bit(lfsr_steps, idx);
+
 		chip->rm_hh_bit2 = (phase >> 2) & 1;
 		chip->rm_hh_bit3 = (phase >> 3) & 1;
 		chip->rm_hh_bit7 = (phase >> 7) & 1;
 		chip->rm_hh_bit8 = (phase >> 8) & 1;
-	}
-	// TC
-	if (slot->channel->channel_idx == 8 && slot->slot_idx == 1)
-	{
-		chip->rm_tc_bit3 = (phase >> 3) & 1;
-		chip->rm_tc_bit5 = (phase >> 5) & 1;
-	}
-	if (chip->emu_rhy_mode_flags & 0x20)
-	{
+
+		chip->rm_tc_bit3 = (prev_phase_out >> 3) & 1;
+		chip->rm_tc_bit5 = (prev_phase_out >> 5) & 1;
+
 		rm_xor = (chip->rm_hh_bit2 ^ chip->rm_hh_bit7)
 			   | (chip->rm_hh_bit3 ^ chip->rm_tc_bit5)
 			   | (chip->rm_tc_bit3 ^ chip->rm_tc_bit5);
-		if (slot->channel->channel_idx == 7)
+
+		switch(slot->rhy_noise)
 		{
-			if (slot->slot_idx == 0) {
+			case 1:
+				// SD
+				state->phase_out[idx] = (chip->rm_hh_bit8 << 9)
+					| ((chip->rm_hh_bit8 ^ noise) << 8);
+				break;
+			case 2:
 				// HH
-				slot->in.phase_out = rm_xor << 9;
-				if (rm_xor ^ (noise & 1))
+				state->phase_out[idx] = rm_xor << 9;
+				if (rm_xor ^ noise)
 				{
-					slot->in.phase_out |= 0xd0;
+					state->phase_out[idx] |= 0xd0;
 				}
 				else
 				{
-					slot->in.phase_out |= 0x34;
+					state->phase_out[idx] |= 0x34;
 				}
-			}
-			else if (slot->slot_idx == 1)
-			{
-				// SD
-				slot->in.phase_out = (chip->rm_hh_bit8 << 9)
-					| ((chip->rm_hh_bit8 ^ (noise & 1)) << 8);
-			}
-		}
-		else if (slot->channel->channel_idx == 8 && slot->slot_idx == 1)
-		{
-			// TC
-			slot->in.phase_out = (rm_xor << 9) | 0x80;
+				break;
+			case 3:
+				// TC
+				state->phase_out[idx] = (rm_xor << 9) | 0x80;
+				break;
 		}
 	}
-
-	n_bit = ((noise >> 14) ^ noise) & 0x01;
-	chip->lfsr = (noise >> 1) | (n_bit << 22);
 }
 
-/**
- * TODO: Figure out what's ACTUALLY going on inside the real chip!
- * This is not accurate at all, but it's the closest I was able to get with
- * empirical testing (and it's closer than nothing).
- */
+#endif
+
+#define EMU_HH_STATE_IDX (7 * ESFM_CHANNEL_SLOTS + 0)
+#define EMU_SD_STATE_IDX (7 * ESFM_CHANNEL_SLOTS + 1)
+#define EMU_TC_STATE_IDX (8 * ESFM_CHANNEL_SLOTS + 1)
 /* ------------------------------------------------------------------------- */
-static int16
-ESFM_slot3_noise3_mod_input_calc(esfm_slot *slot)
+static ESFM_FORCE_INLINE void
+ESFM_process_phases_emu(esfm_chip *chip, const flag rhythm_mode)
 {
-	esfm_channel *channel = slot->channel;
-	int16 phase;
-	int13 output_buf = *channel->slots[1].in.mod_input;
-	int i;
-	
-	// Go through previous slots' partial results and recalculate outputs
-	// (we skip slot 0 because its calculation happens at the end, not at the beginning)
-	for (i = 1; i < 3; i++)
+	esfm_slot_state *state = &chip->slot_state;
+	uint23 lfsr_steps[18 * 2 / 9];
+	uint10 hh_phase, tc_phase;
+	bool rm_xor;
+	int channel_idx;
+
+	if (chip->phase_inc_vibrato_pos != chip->vibrato_pos)
 	{
-		// double the pitch
-		phase = channel->slots[i].in.phase_acc >> 8;
-		if (channel->slots[i].mod_in_level)
-		{
-			phase += output_buf >> (7 - channel->slots[i].mod_in_level);
-		}
-		output_buf = ESFM_envelope_wavegen(channel->slots[2].waveform, phase, channel->slots[i].in.eg_output);
+		ESFM_update_phase_increments(chip);
 	}
+	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	{
+		ESFM_phase_advance(state, channel_idx * ESFM_CHANNEL_SLOTS);
+		ESFM_phase_advance(state, channel_idx * ESFM_CHANNEL_SLOTS + 1);
+	}
+	ESFM_lfsr_advance(chip, lfsr_steps, 18 * 2);
 
-	return output_buf >> (8 - slot->mod_in_level);
-}
-
-/* ------------------------------------------------------------------------- */
-static void
-ESFM_slot_generate(esfm_slot *slot)
-{
-	int16 phase = slot->in.phase_out;
-	if (slot->mod_in_level)
+	/* Noise mode (rhythm) sounds */
+	// The HH slot comes before the TC slot, so it sees the TC bits from the
+	// previous sample
+	hh_phase = state->phase_out[EMU_HH_STATE_IDX];
+	tc_phase = state->phase_out[EMU_TC_STATE_IDX];
+	chip->rm_hh_bit2 = (hh_phase >> 2) & 1;
+	chip->rm_hh_bit3 = (hh_phase >> 3) & 1;
+	chip->rm_hh_bit7 = (hh_phase >> 7) & 1;
+	chip->rm_hh_bit8 = (hh_phase >> 8) & 1;
+	if (rhythm_mode)
 	{
-		if (slot->slot_idx == 3 && slot->rhy_noise == 3)
+		// LFSR clock counts: two per channel before these slots
+		bool hh_noise = ESFM_lfsr_noise_bit(lfsr_steps, 7 * 2 + 0);
+		bool sd_noise = ESFM_lfsr_noise_bit(lfsr_steps, 7 * 2 + 1);
+
+		rm_xor = (chip->rm_hh_bit2 ^ chip->rm_hh_bit7)
+			   | (chip->rm_hh_bit3 ^ chip->rm_tc_bit5)
+			   | (chip->rm_tc_bit3 ^ chip->rm_tc_bit5);
+		// HH
+		state->phase_out[EMU_HH_STATE_IDX] = rm_xor << 9;
+		if (rm_xor ^ hh_noise)
 		{
-			phase += ESFM_slot3_noise3_mod_input_calc(slot);
+			state->phase_out[EMU_HH_STATE_IDX] |= 0xd0;
 		}
 		else
 		{
-			phase += *slot->in.mod_input >> (7 - slot->mod_in_level);
+			state->phase_out[EMU_HH_STATE_IDX] |= 0x34;
 		}
+		// SD
+		state->phase_out[EMU_SD_STATE_IDX] = (chip->rm_hh_bit8 << 9)
+			| ((chip->rm_hh_bit8 ^ sd_noise) << 8);
+	}
+	chip->rm_tc_bit3 = (tc_phase >> 3) & 1;
+	chip->rm_tc_bit5 = (tc_phase >> 5) & 1;
+	if (rhythm_mode)
+	{
+		rm_xor = (chip->rm_hh_bit2 ^ chip->rm_hh_bit7)
+			   | (chip->rm_hh_bit3 ^ chip->rm_tc_bit5)
+			   | (chip->rm_tc_bit3 ^ chip->rm_tc_bit5);
+		// TC
+		state->phase_out[EMU_TC_STATE_IDX] = (rm_xor << 9) | 0x80;
 	}
-	slot->in.output = ESFM_envelope_wavegen(slot->waveform, phase, slot->in.eg_output);
+}
+
+#ifndef _ESFMU_EMU_ONLY
+/* ------------------------------------------------------------------------- */
+static ESFM_FORCE_INLINE void
+ESFM_slot_output(esfm_slot *slot, int16 phase)
+{
+	esfm_slot_state *state = &slot->chip->slot_state;
+	uint7 idx = slot->state_idx;
+	state->output[idx] = ESFM_envelope_wavegen(slot->waveform, phase, state->eg_output[idx]);
 	if (slot->output_level)
 	{
-		int13 output_value = slot->in.output >> (7 - slot->output_level);
+		int13 output_value = state->output[idx] >> (7 - slot->output_level);
 		slot->channel->output[0] += output_value & slot->out_enable[0];
 		slot->channel->output[1] += output_value & slot->out_enable[1];
 	}
@@ -1716,18 +1985,46 @@ ESFM_slot_generate(esfm_slot *slot)
 
 /* ------------------------------------------------------------------------- */
 static void
-ESFM_slot_generate_emu(esfm_slot *slot)
+ESFM_slot_generate(esfm_slot *slot)
+{
+	esfm_slot_state *state = &slot->chip->slot_state;
+	uint7 idx = slot->state_idx;
+	int16 phase = state->phase_out[idx];
+	if (state->eg_output[idx] >= ESFM_EG_SILENT_LEVEL)
+	{
+		state->output[idx] = 0;
+		return;
+	}
+	if (slot->mod_in_level)
+	{
+		phase += *slot->in.mod_input >> (7 - slot->mod_in_level);
+	}
+	ESFM_slot_output(slot, phase);
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+static ESFM_FORCE_INLINE void
+ESFM_slot_generate_emu(esfm_slot *slot, const esfm_block_state *block_state,
+	const flag rhythm_mode)
 {
-	const esfm_chip *chip = slot->chip;
-	uint3 waveform = slot->waveform & (chip->emu_newmode != 0 ? 0x07 : 0x03);
-	bool rhythm_slot_double_volume = (slot->chip->emu_rhy_mode_flags & 0x20) != 0
+	esfm_chip *chip = slot->chip;
+	esfm_slot_state *state = &chip->slot_state;
+	uint7 idx = slot->state_idx;
+	uint3 waveform = slot->waveform & block_state->emu_waveform_mask;
+	bool rhythm_slot_double_volume = rhythm_mode
 		&& slot->channel->channel_idx >= 6 && slot->channel->channel_idx < 9;
-	int16 phase = slot->in.phase_out;
+	int16 phase = state->phase_out[idx];
 	int14 output_value;
 
+	if (state->eg_output[idx] >= ESFM_EG_SILENT_LEVEL)
+	{
+		state->output[idx] = 0;
+		return;
+	}
 	phase += *slot->in.mod_input & slot->in.emu_mod_enable;
-	slot->in.output = ESFM_envelope_wavegen(waveform, phase, slot->in.eg_output);
-	output_value = (slot->in.output & slot->in.emu_output_enable) << rhythm_slot_double_volume;
+	state->output[idx] = ESFM_envelope_wavegen(waveform, phase, state->eg_output[idx]);
+	output_value = (state->output[idx] & slot->in.emu_output_enable) << rhythm_slot_double_volume;
 	if (chip->emu_newmode)
 	{
 		slot->channel->output[0] += output_value & slot->channel->slots[0].out_enable[0];
@@ -1740,308 +2037,440 @@ ESFM_slot_generate_emu(esfm_slot *slot)
 	}
 }
 
+/*
+ * Inputs and outputs of the feedback chains that run in a given sample, laid
+ * out lane by lane (and padded to a multiple of 8 lanes) so that they can be
+ * processed by vector kernels. There's room for the chains of a whole group
+ * of batch-rendered chips.
+ */
+#define ESFM_BATCH_GROUP_SIZE 4
+#define ESFM_FEEDBACK_LANES (18 * ESFM_BATCH_GROUP_SIZE)
+typedef struct _esfm_feedback_chains
+{
+	uint32_t phase_acc[ESFM_FEEDBACK_LANES];
+	uint32_t phase_offset[ESFM_FEEDBACK_LANES];
+	uint32_t waveform[ESFM_FEEDBACK_LANES];
+	uint32_t envelope[ESFM_FEEDBACK_LANES];
+	uint32_t mod_in_shift[ESFM_FEEDBACK_LANES];
+	int32_t phase_feedback[ESFM_FEEDBACK_LANES];
+
+} esfm_feedback_chains;
+
 /* ------------------------------------------------------------------------- */
-#pragma GCC diagnostic ignored "-Wunused-variable"
-#pragma GCC diagnostic ignored "-Wunknown-pragmas"
-#pragma clang diagnostic ignored "-Wunused-variable"
-#pragma clang diagnostic ignored "-Wunknown-pragmas"
 static void
-ESFM_process_feedback(esfm_chip *chip)
+ESFM_feedback_chains_scalar(esfm_feedback_chains *chains, int num_chains, int num_iterations)
 {
-	int channel_idx;
+	// Each channel's feedback runs a chain of 29 dependent wavegen steps.
+	// The chains of different channels don't depend on each other, so they're
+	// interleaved step by step to keep several table lookups in flight at once
+	// instead of stalling on each one.
+	int32_t wave_out[ESFM_FEEDBACK_LANES], wave_last[ESFM_FEEDBACK_LANES];
+	int iter_counter, i;
+
+	for (i = 0; i < num_chains; i++)
+	{
+		wave_out[i] = wave_last[i] = 0;
+	}
 
-	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	for (iter_counter = 0; iter_counter < num_iterations; iter_counter++)
 	{
-		esfm_slot *slot = &chip->channels[channel_idx].slots[0];
-		uint32 basefreq, phase_offset;
-		uint3 block;
-		uint10 f_num;
-		int32_t wave_out, wave_last;
-		int32_t phase_feedback;
-		uint32_t iter_counter;
-		uint3 waveform;
-		uint3 mod_in_shift;
-		uint32_t phase, phase_acc;
-		uint10 eg_output;
-
-		if (slot->mod_in_level && (chip->native_mode || (slot->in.mod_input == &slot->in.feedback_buf)))
-		{
-			if (chip->native_mode)
+		for (i = 0; i < num_chains; i++)
+		{
+			uint32_t phase;
+			uint16 lookup, level;
+			int32_t out;
+
+			chains->phase_feedback[i] = (wave_out[i] + wave_last[i]) >> 2;
+			wave_last[i] = wave_out[i];
+			phase = chains->phase_feedback[i] >> chains->mod_in_shift[i];
+			phase += chains->phase_acc[i] >> 9;
+			// Same as ESFM_envelope_wavegen
+			lookup = ESFM_logsin_lookup(chains->waveform[i], phase & 0x3ff);
+			level = (lookup & 0x1fff) + chains->envelope[i];
+			if (level > 0x1fff)
 			{
-				waveform = slot->waveform;
+				level = 0x1fff;
 			}
-			else
+			out = exprom[level & 0xff] >> (level >> 8);
+			if (lookup & 0x8000)
 			{
-				waveform = slot->waveform & (0x03 | (0x02 << (chip->emu_newmode != 0)));
+				out = -out;
 			}
-			f_num = slot->f_num;
-			block = slot->block;
-			basefreq = (f_num << block) >> 1;
-			phase_offset = (basefreq * mt[slot->mult]) >> 1;
-			mod_in_shift = 7 - slot->mod_in_level;
-			phase_acc = (uint32_t)(slot->in.phase_acc - phase_offset * 28);
-			eg_output = slot->in.eg_output;
-
-			// ASM optimizaions!
-#if defined(__GNUC__) && defined(__x86_64__) && !defined(_ESFMU_DISABLE_ASM_OPTIMIZATIONS)
-			asm (
-				"movzbq  %[wave], %%r8               \n\t"
-				"shll    $11, %%r8d                  \n\t"
-				"leaq    %[sinrom], %%rax            \n\t"
-				"addq    %%rax, %%r8                 \n\t"
-				"leaq    %[exprom], %%r9             \n\t"
-				"movzwl  %[eg_out], %%r10d           \n\t"
-				"shll    $3, %%r10d                  \n\t"
-				"xorl    %%r11d, %%r11d              \n\t"
-				"movl    %%r11d, %[out]              \n\t"
-				"movl    $29, %%edx                  \n"
-				"1:                                  \n\t"
-				// phase_feedback = (wave_out + wave_last) >> 2;
-				"movl    %[out], %[p_fb]             \n\t"
-				"addl    %%r11d, %[p_fb]             \n\t"
-				"sarl    $2, %[p_fb]                 \n\t"
-				// wave_last = wave_out
-				"movl    %[out], %%r11d              \n\t"
-				// phase = phase_feedback >> mod_in_shift;
-				"movl    %[p_fb], %%eax              \n\t"
-				"movb    %[mod_in], %%cl             \n\t"
-				"sarl    %%cl, %%eax                 \n\t"
-				// phase += phase_acc >> 9;
-				"movl    %[p_acc], %%ebx             \n\t"
-				"sarl    $9, %%ebx                   \n\t"
-				"addl    %%ebx, %%eax                \n\t"
-				// lookup = logsinrom[(waveform << 10) | (phase & 0x3ff)];
-				"andq    $0x3ff, %%rax               \n\t"
-				"movzwl  (%%r8, %%rax, 2), %%ebx     \n\t"
-				"movl    %%ebx, %%eax                \n\t"
-				// level = (lookup & 0x1fff) + (envelope << 3);
-				"movl    $0x1fff, %%ecx              \n\t"
-				"andl    %%ecx, %%eax                \n\t"
-				"addl    %%r10d, %%eax               \n\t"
-				// if (level > 0x1fff) level = 0x1fff;
-				"cmpl    %%ecx, %%eax                \n\t"
-				"cmoval  %%ecx, %%eax                \n\t"
-				// wave_out = exprom[level & 0xff] >> (level >> 8);
-				"movb    %%ah, %%cl                  \n\t"
-				"movzbl  %%al, %%eax                 \n\t"
-				"movzwl  (%%r9, %%rax, 2), %[out]    \n\t"
-				"shrl    %%cl, %[out]                \n\t"
-				// if (lookup & 0x8000) wave_out = -wave_out;
-				// in other words, lookup is negative
-				"movl    %[out], %%ecx               \n\t"
-				"negl    %%ecx                       \n\t"
-				"testw   %%bx, %%bx                  \n\t"
-				"cmovsl  %%ecx, %[out]               \n\t"
-				// phase_acc += phase_offset
-				"addl    %[p_off], %[p_acc]          \n\t"
-				// loop
-				"decl    %%edx                       \n\t"
-				"jne     1b                          \n\t"
-				: [p_fb]   "=&r" (phase_feedback),
-				  [p_acc]  "+r"  (phase_acc),
-				  [out]    "=&r" (wave_out)
-				: [p_off]  "r"   (phase_offset),
-				  [mod_in] "r"   (mod_in_shift),
-				  [wave]   "g"   (waveform),
-				  [eg_out] "g"   (eg_output),
-				  [sinrom] "m"   (logsinrom),
-				  [exprom] "m"   (exprom)
-				: "cc", "ax", "bx", "cx", "dx", "r8", "r9", "r10", "r11"
-			);
-#elif defined(__GNUC__) && defined(__i386__) && !defined(_ESFMU_DISABLE_ASM_OPTIMIZATIONS)
-			size_t logsinrom_addr = (size_t)logsinrom;
-			size_t exprom_addr = (size_t)exprom;
-
-			asm (
-				"movzbl  %b[wave], %%eax             \n\t"
-				"shll    $11, %%eax                  \n\t"
-				"movl    %[sinrom], %%edi            \n\t"
-				"addl    %%eax, %%edi                \n\t"
-				"shlw    $3, %[eg_out]               \n\t"
-				"xorl    %[out], %[out]              \n\t"
-				"movl    %[out], %[last]             \n\t"
-				"movl    $29, %[i]                   \n"
-				"1:                                  \n\t"
-				// phase_feedback = (wave_out + wave_last) >> 2;
-				"movl    %[out], %%eax               \n\t"
-				"addl    %[last], %%eax              \n\t"
-				"sarl    $2, %%eax                   \n\t"
-				"movl    %%eax, %[p_fb]              \n\t"
-				// wave_last = wave_out
-				"movl    %[out], %[last]             \n\t"
-				// phase = phase_feedback >> mod_in_shift;
-				"movb    %[mod_in], %%cl             \n\t"
-				"sarl    %%cl, %%eax                 \n\t"
-				// phase += phase_acc >> 9;
-				"movl    %[p_acc], %%ebx             \n\t"
-				"shrl    $9, %%ebx                   \n\t"
-				"addl    %%ebx, %%eax                \n\t"
-				// lookup = logsinrom[(waveform << 10) | (phase & 0x3ff)];
-				"andl    $0x3ff, %%eax               \n\t"
-				"movzwl  (%%edi, %%eax, 2), %%ebx    \n\t"
-				"movl    %%ebx, %%eax                \n\t"
-				// level = (lookup & 0x1fff) + (envelope << 3);
-				"movl    $0x1fff, %%ecx              \n\t"
-				"andl    %%ecx, %%eax                \n\t"
-				"addw    %[eg_out], %%ax             \n\t"
-				// if (level > 0x1fff) level = 0x1fff;
-				"cmpl    %%ecx, %%eax                \n\t"
-				"cmoval  %%ecx, %%eax                \n\t"
-				// wave_out = exprom[level & 0xff] >> (level >> 8);
-				"movb    %%ah, %%cl                  \n\t"
-				"movzbl  %%al, %%eax                 \n\t"
-				"movl    %[exprom], %[out]           \n\t"
-				"movzwl  (%[out], %%eax, 2), %[out]  \n\t"
-				"shrl    %%cl, %[out]                \n\t"
-				// if (lookup & 0x8000) wave_out = -wave_out;
-				// in other words, lookup is negative
-				"movl    %[out], %%ecx               \n\t"
-				"negl    %%ecx                       \n\t"
-				"testw   %%bx, %%bx                  \n\t"
-				"cmovsl  %%ecx, %[out]               \n\t"
-				// phase_acc += phase_offset
-				"addl    %[p_off], %[p_acc]          \n\t"
-				// loop
-				"decl    %[i]                        \n\t"
-				"jne     1b                          \n\t"
-				: [p_fb]   "=&m" (phase_feedback),
-				  [p_acc]  "+r"  (phase_acc),
-				  [out]    "=&r" (wave_out),
-				  [last]   "=&m" (wave_last),
-				  [eg_out] "+m"  (eg_output)
-				: [p_off]  "m"   (phase_offset),
-				  [mod_in] "m"   (mod_in_shift),
-				  [wave]   "m"   (waveform),
-				  [sinrom] "m"   (logsinrom_addr),
-				  [exprom] "m"   (exprom_addr),
-				  [i]      "m"   (iter_counter)
-				: "cc", "ax", "bx", "cx", "di"
-			);
-#elif defined(__GNUC__) && defined(__arm__) && !defined(_ESFMU_DISABLE_ASM_OPTIMIZATIONS)
-			asm (
-				"movs    r3, #0                     \n\t"
-				"movs    %[out], #0                 \n\t"
-				"ldr     r8, =0x1fff                \n\t"
-				"movs    r2, #29                    \n"
-				"1:                                 \n\t"
-				// phase_feedback = (wave_out + wave_last) >> 2;
-				"adds    %[p_fb], %[out], r3        \n\t"
-				"asrs    %[p_fb], %[p_fb], #2       \n\t"
-				// wave_last = wave_out
-				"mov     r3, %[out]                 \n\t"
-				// phase = phase_feedback >> mod_in_shift;
-				"asr     r0, %[p_fb], %[mod_in]     \n\t"
-				// phase += phase_acc >> 9;
-				"add     r0, r0, %[p_acc], asr #9   \n\t"
-				// lookup = logsinrom[(waveform << 10) | (phase & 0x3ff)];
-				"lsls    r0, r0, #22                \n\t"
-				"lsrs    r0, r0, #21                \n\t"
-				"ldrsh   r1, [%[sinrom], r0]        \n\t"
-				// level = (lookup & 0x1fff) + (envelope << 3);
-				"and     r0, r8, r1                 \n\t"
-				"add     r0, r0, %[eg_out], lsl #3  \n\t"
-				// if (level > 0x1fff) level = 0x1fff;
-				"cmp     r0, r8                     \n\t"
-				"it      hi                         \n\t"
-				"movhi   r0, r8                     \n\t"
-				// wave_out = exprom[level & 0xff] >> (level >> 8);
-				"lsrs    %[out], r0, #8             \n\t"
-				"ands    r0, r0, #255               \n\t"
-				"lsls    r0, r0, #1                 \n\t"
-				"ldrh    r0, [%[exprom], r0]        \n\t"
-				"lsr     %[out], r0, %[out]         \n\t"
-				// if (lookup & 0x8000) wave_out = -wave_out;
-				// in other words, lookup is negative
-				"tst     r1, r1                     \n\t"
-				"it      mi                         \n\t"
-				"negmi   %[out], %[out]             \n\t"
-				// phase_acc += phase_offset
-				"adds    %[p_acc], %[p_acc], %[p_off]\n\t"
-				// loop
-				"subs    r2, r2, #1                 \n\t"
-				"bne     1b                         \n\t"
-				: [p_fb]   "=&r" (phase_feedback),
-				  [p_acc]  "+r"  (phase_acc),
-				  [out]    "=&r" (wave_out)
-				: [p_off]  "r"   (phase_offset),
-				  [mod_in] "r"   (mod_in_shift),
-				  [eg_out] "r"   (eg_output),
-				  [sinrom] "r"   (logsinrom + waveform * 1024),
-				  [exprom] "r"   (exprom)
-				: "cc", "r0", "r1", "r2", "r3", "r8"
-			);
+			wave_out[i] = out;
+			chains->phase_acc[i] += chains->phase_offset[i];
+		}
+	}
+}
+
+#ifdef ESFM_FEEDBACK_AVX2
+/* ------------------------------------------------------------------------- */
+__attribute__((target("avx2")))
+static void
+ESFM_feedback_chains_avx2(esfm_feedback_chains *chains, int num_chains, int num_iterations)
+{
+	// Same computation as ESFM_feedback_chains_scalar, 8 chains per vector,
+	// with the table lookups done through 32-bit gathers
+	const __m256i mask_lo16 = _mm256_set1_epi32(0xffff);
+	const __m256i mask_1fff = _mm256_set1_epi32(0x1fff);
+	const __m256i mask_3ff = _mm256_set1_epi32(0x3ff);
+	const __m256i mask_ff = _mm256_set1_epi32(0xff);
+	__m256i phase_acc[ESFM_FEEDBACK_LANES / 8];
+	__m256i wave_out[ESFM_FEEDBACK_LANES / 8];
+	__m256i wave_last[ESFM_FEEDBACK_LANES / 8];
+	__m256i phase_feedback[ESFM_FEEDBACK_LANES / 8];
+#ifdef _ESFMU_SMALL_TABLES
+	const __m256i mask_1ff = _mm256_set1_epi32(0x1ff);
+	const __m256i bit_8 = _mm256_set1_epi32(0x100);
+	const __m256i silent_level = _mm256_set1_epi32(0x1000);
+	__m256i fold_shift[ESFM_FEEDBACK_LANES / 8];
+	__m256i fold_mirror[ESFM_FEEDBACK_LANES / 8];
+	__m256i fold_silent_mask[ESFM_FEEDBACK_LANES / 8];
+	__m256i fold_sign_mask[ESFM_FEEDBACK_LANES / 8];
+	__m256i fold_saw_mask[ESFM_FEEDBACK_LANES / 8];
+	__m256i fold_saw[ESFM_FEEDBACK_LANES / 8];
+#endif
+	int num_vectors = (num_chains + 7) / 8;
+	int iter_counter, v;
+
+	for (v = 0; v < num_vectors; v++)
+	{
+#ifdef _ESFMU_SMALL_TABLES
+		const __m256i waveform = _mm256_loadu_si256((const __m256i *)&chains->waveform[v * 8]);
+		fold_shift[v] = _mm256_permutevar8x32_epi32(
+			_mm256_loadu_si256((const __m256i *)waveform_folds.shift), waveform);
+		fold_mirror[v] = _mm256_permutevar8x32_epi32(
+			_mm256_loadu_si256((const __m256i *)waveform_folds.mirror), waveform);
+		fold_silent_mask[v] = _mm256_permutevar8x32_epi32(
+			_mm256_loadu_si256((const __m256i *)waveform_folds.silent_mask), waveform);
+		fold_sign_mask[v] = _mm256_permutevar8x32_epi32(
+			_mm256_loadu_si256((const __m256i *)waveform_folds.sign_mask), waveform);
+		fold_saw_mask[v] = _mm256_permutevar8x32_epi32(
+			_mm256_loadu_si256((const __m256i *)waveform_folds.saw_mask), waveform);
+		fold_saw[v] = _mm256_permutevar8x32_epi32(
+			_mm256_loadu_si256((const __m256i *)waveform_folds.saw), waveform);
+#endif
+		phase_acc[v] = _mm256_loadu_si256((const __m256i *)&chains->phase_acc[v * 8]);
+		wave_out[v] = wave_last[v] = phase_feedback[v] = _mm256_setzero_si256();
+	}
+
+	for (iter_counter = 0; iter_counter < num_iterations; iter_counter++)
+	{
+		for (v = 0; v < num_vectors; v++)
+		{
+#ifndef _ESFMU_SMALL_TABLES
+			const __m256i sinrom_offset = _mm256_slli_epi32(
+				_mm256_loadu_si256((const __m256i *)&chains->waveform[v * 8]), 10);
+#else
+			__m256i folded, sign, silent, saw;
+#endif
+			const __m256i envelope =
+				_mm256_loadu_si256((const __m256i *)&chains->envelope[v * 8]);
+			const __m256i mod_in_shift =
+				_mm256_loadu_si256((const __m256i *)&chains->mod_in_shift[v * 8]);
+			const __m256i phase_offset =
+				_mm256_loadu_si256((const __m256i *)&chains->phase_offset[v * 8]);
+			__m256i phase, lookup, level, out, negative;
+
+			phase_feedback[v] = _mm256_srai_epi32(_mm256_add_epi32(wave_out[v], wave_last[v]), 2);
+			wave_last[v] = wave_out[v];
+			phase = _mm256_srav_epi32(phase_feedback[v], mod_in_shift);
+			phase = _mm256_add_epi32(phase, _mm256_srli_epi32(phase_acc[v], 9));
+#ifndef _ESFMU_SMALL_TABLES
+			phase = _mm256_or_si256(sinrom_offset, _mm256_and_si256(phase, mask_3ff));
+			lookup = _mm256_and_si256(
+				_mm256_i32gather_epi32((const int *)logsinrom, phase, 2), mask_lo16);
+#else
+			// Same as ESFM_logsin_lookup, with the sign kept apart
+			phase = _mm256_and_si256(phase, mask_3ff);
+			folded = _mm256_sllv_epi32(phase, fold_shift[v]);
+			folded = _mm256_xor_si256(folded, _mm256_and_si256(fold_mirror[v],
+				_mm256_cmpeq_epi32(_mm256_and_si256(folded, bit_8), bit_8)));
+			lookup = _mm256_and_si256(_mm256_i32gather_epi32((const int *)logsinrom,
+				_mm256_and_si256(folded, mask_ff), 2), mask_lo16);
+			sign = _mm256_cmpgt_epi32(_mm256_and_si256(phase, fold_sign_mask[v]),
+				_mm256_setzero_si256());
+			saw = _mm256_slli_epi32(_mm256_xor_si256(_mm256_and_si256(phase, mask_1ff),
+				_mm256_and_si256(sign, mask_1ff)), 3);
+			lookup = _mm256_blendv_epi8(lookup, _mm256_and_si256(saw, fold_saw_mask[v]),
+				fold_saw[v]);
+			silent = _mm256_cmpgt_epi32(_mm256_and_si256(phase, fold_silent_mask[v]),
+				_mm256_setzero_si256());
+			lookup = _mm256_blendv_epi8(lookup, silent_level, silent);
+#endif
+			level = _mm256_add_epi32(_mm256_and_si256(lookup, mask_1fff), envelope);
+			level = _mm256_min_epi32(level, mask_1fff);
+			out = _mm256_and_si256(
+				_mm256_i32gather_epi32((const int *)exprom, _mm256_and_si256(level, mask_ff), 2),
+				mask_lo16);
+			out = _mm256_srlv_epi32(out, _mm256_srli_epi32(level, 8));
+#ifndef _ESFMU_SMALL_TABLES
+			// all ones where bit 15 of the lookup (the sign) is set
+			negative = _mm256_srai_epi32(_mm256_slli_epi32(lookup, 16), 31);
+#else
+			negative = sign;
+#endif
+			wave_out[v] = _mm256_sub_epi32(_mm256_xor_si256(out, negative), negative);
+			phase_acc[v] = _mm256_add_epi32(phase_acc[v], phase_offset);
+		}
+	}
+
+	for (v = 0; v < num_vectors; v++)
+	{
+		_mm256_storeu_si256((__m256i *)&chains->phase_feedback[v * 8], phase_feedback[v]);
+	}
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+static int
+ESFM_feedback_gather(const esfm_block_state *block_state, esfm_feedback_chains *chains,
+	esfm_slot **chain_slots, uint3 *chain_out_shift, int num_chains)
+{
+	// Appends the chip's audible feedback chains to the lanes after
+	// num_chains; returns the new number of lanes in use
+	int fb_idx;
+
+	for (fb_idx = 0; fb_idx < block_state->num_feedback; fb_idx++)
+	{
+		const esfm_feedback_setup *setup = &block_state->feedback[fb_idx];
+		esfm_slot *slot = setup->slot;
+		const esfm_slot_state *state = &slot->chip->slot_state;
+		uint10 eg_output = state->eg_output[slot->state_idx];
+
+		if (eg_output >= ESFM_EG_SILENT_LEVEL)
+		{
+			// Every iteration would output zero
+			slot->in.feedback_buf = 0;
+			continue;
+		}
+		chain_slots[num_chains] = slot;
+		chain_out_shift[num_chains] = setup->out_shift;
+		chains->phase_acc[num_chains] = (uint32_t)(state->phase_acc[slot->state_idx]
+			- setup->phase_offset * (block_state->feedback_iterations - 1));
+		chains->phase_offset[num_chains] = setup->phase_offset;
+		chains->waveform[num_chains] = setup->waveform;
+		chains->envelope[num_chains] = (uint32_t)eg_output << 3;
+		chains->mod_in_shift[num_chains] = setup->mod_in_shift;
+		num_chains++;
+		ESFM_STATS_ADD(slot->chip, feedback_chains, 1);
+		ESFM_STATS_ADD(slot->chip, feedback_iterations, block_state->feedback_iterations);
+	}
+	return num_chains;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_feedback_run(esfm_feedback_chains *chains, esfm_slot **chain_slots,
+	const uint3 *chain_out_shift, int num_chains, int num_iterations, flag use_avx2)
+{
+	int i;
+
+	if (num_chains == 0)
+	{
+		return;
+	}
+
+#ifdef ESFM_FEEDBACK_AVX2
+	if (use_avx2)
+	{
+		// pad the last vector with harmless all-zero chains
+		for (i = num_chains; i < ((num_chains + 7) & ~7); i++)
+		{
+			chains->phase_acc[i] = chains->phase_offset[i] = chains->waveform[i] = 0;
+			chains->envelope[i] = chains->mod_in_shift[i] = 0;
+		}
+		ESFM_feedback_chains_avx2(chains, num_chains, num_iterations);
+	}
+	else
 #else
-			wave_out = 0;
-			wave_last = 0;
-			for (iter_counter = 0; iter_counter < 29; iter_counter++)
+	(void)use_avx2;
+#endif
+	{
+		ESFM_feedback_chains_scalar(chains, num_chains, num_iterations);
+	}
+
+	for (i = 0; i < num_chains; i++)
+	{
+		// TODO: Figure out - is this how the ESFM chip does it, like the
+		// patent literally says? (it's really hacky...)
+		//   slot->in.output = wave_out;
+
+		// This would be the more canonical way to do it, reusing the rest of
+		// the synthesis pipeline to finish the calculation:
+		chain_slots[i]->in.feedback_buf = chains->phase_feedback[i] >> chain_out_shift[i];
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_process_feedback(esfm_chip *chip, const esfm_block_state *block_state)
+{
+	esfm_feedback_chains chains;
+	esfm_slot *chain_slots[18];
+	uint3 chain_out_shift[18];
+	int num_chains;
+	ESFM_STATS_TIMER(stage_timer);
+
+	num_chains = ESFM_feedback_gather(block_state, &chains, chain_slots, chain_out_shift, 0);
+	ESFM_feedback_run(&chains, chain_slots, chain_out_shift, num_chains,
+		block_state->feedback_iterations, block_state->feedback_avx2);
+	ESFM_STATS_LAP(chip, stage_timer, ESFM_STAGE_FEEDBACK);
+}
+
+#ifndef _ESFMU_EMU_ONLY
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_process_envelopes_native(esfm_chip *chip)
+{
+	esfm_eg_clock clock;
+	int channel_idx, slot_idx;
+	ESFM_STATS_ADD(chip, samples, 1);
+
+	clock.clocks = chip->eg_clocks;
+	clock.tick = chip->eg_tick;
+	clock.step = chip->global_timer & 0x03;
+	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	{
+		esfm_channel *channel = &chip->channels[channel_idx];
+		for (slot_idx = 0; slot_idx < 4; slot_idx++)
+		{
+			esfm_slot *slot = &channel->slots[slot_idx];
+			if (channel->slots_active & (1 << slot_idx))
+			{
+				ESFM_STATS_ADD(chip, active_slots, 1);
+				ESFM_envelope_calc(slot, *slot->in.key_on, &clock, 1, 0);
+			}
+			else
 			{
-				phase_feedback = (wave_out + wave_last) >> 2;
-				wave_last = wave_out;
-				phase = phase_feedback >> mod_in_shift;
-				phase += phase_acc >> 9;
-				wave_out = ESFM_envelope_wavegen(waveform, phase, eg_output);
-				phase_acc += phase_offset;
+				ESFM_envelope_update_output(slot);
 			}
+		}
+	}
+}
 #endif
 
-			// TODO: Figure out - is this how the ESFM chip does it, like the
-			// patent literally says? (it's really hacky...)
-			//   slot->in.output = wave_out;
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_process_envelopes_emu(esfm_chip *chip, const esfm_block_state *block_state)
+{
+	esfm_eg_clock clock;
+	int channel_idx, slot_idx;
+	ESFM_STATS_ADD(chip, samples, 1);
 
-			// This would be the more canonical way to do it, reusing the rest of
-			// the synthesis pipeline to finish the calculation:
-			if (chip->native_mode)
+	clock.clocks = chip->eg_clocks;
+	clock.tick = chip->eg_tick;
+	clock.step = chip->global_timer & 0x03;
+	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	{
+		esfm_channel *channel = &chip->channels[channel_idx];
+		for (slot_idx = 0; slot_idx < 2; slot_idx++)
+		{
+			esfm_slot *slot = &channel->slots[slot_idx];
+			if (channel->slots_active & (1 << slot_idx))
 			{
-				slot->in.feedback_buf = phase_feedback;
+				ESFM_STATS_ADD(chip, active_slots, 1);
+				ESFM_envelope_calc(slot, *block_state->emu_key_on[channel_idx * 2 + slot_idx],
+					&clock, 0, 0);
 			}
 			else
 			{
-				slot->in.feedback_buf = phase_feedback >> (7 - slot->mod_in_level);
+				ESFM_envelope_update_output(slot);
 			}
 		}
 	}
 }
 
+#ifndef _ESFMU_EMU_ONLY
+/**
+ * TODO: Figure out what's ACTUALLY going on inside the real chip!
+ * This is not accurate at all, but it's the closest I was able to get with
+ * empirical testing (and it's closer than nothing).
+ */
 /* ------------------------------------------------------------------------- */
 static void
-ESFM_process_channel(esfm_channel *channel)
+ESFM_process_channel_noise3(esfm_channel *channel)
 {
-	int slot_idx;
-	channel->output[0] = channel->output[1] = 0;
-	for (slot_idx = 0; slot_idx < 4; slot_idx++)
+	// Slot 3 in noise mode 3 is modulated by slots 1 and 2 recalculated at
+	// double the pitch (with slot 2's waveform for both), so that chain is
+	// run alongside the regular outputs of slots 1 and 2 rather than after
+	// them. It starts from slot 1's regular modulation input, which is
+	// slot 0's output from the previous sample, since slot 0 goes last.
+	const esfm_slot_state *state = &channel->chip->slot_state;
+	esfm_slot *slot3 = &channel->slots[3];
+	flag chain_needed = slot3->mod_in_level
+		&& state->eg_output[slot3->state_idx] < ESFM_EG_SILENT_LEVEL;
+	int13 chain_output = *channel->slots[1].in.mod_input;
+	int16 phase;
+	int i;
+
+	for (i = 1; i < 3; i++)
 	{
-		esfm_slot *slot = &channel->slots[slot_idx];
-		ESFM_envelope_calc(slot);
-		ESFM_phase_generate(slot);
-		if(slot_idx > 0)
+		esfm_slot *slot = &channel->slots[i];
+		if (chain_needed)
 		{
-			ESFM_slot_generate(slot);
+			if (state->eg_output[slot->state_idx] >= ESFM_EG_SILENT_LEVEL)
+			{
+				chain_output = 0;
+			}
+			else
+			{
+				// double the pitch
+				phase = state->phase_acc[slot->state_idx] >> 8;
+				if (slot->mod_in_level)
+				{
+					phase += chain_output >> (7 - slot->mod_in_level);
+				}
+				chain_output = ESFM_envelope_wavegen(channel->slots[2].waveform, phase,
+					state->eg_output[slot->state_idx]);
+			}
 		}
+		ESFM_slot_generate(slot);
 	}
-	// ESFM feedback calculation takes a large number of clock cycles, so
-	// defer slot 0 generation to the end
-	// TODO: verify this behavior on real hardware
+
+	if (state->eg_output[slot3->state_idx] >= ESFM_EG_SILENT_LEVEL)
+	{
+		channel->chip->slot_state.output[slot3->state_idx] = 0;
+		return;
+	}
+	phase = state->phase_out[slot3->state_idx];
+	if (slot3->mod_in_level)
+	{
+		phase += chain_output >> (8 - slot3->mod_in_level);
+	}
+	ESFM_slot_output(slot3, phase);
 }
 
 /* ------------------------------------------------------------------------- */
 static void
-ESFM_process_channel_emu(esfm_channel *channel)
+ESFM_process_channel(esfm_channel *channel)
 {
 	int slot_idx;
 	channel->output[0] = channel->output[1] = 0;
-	for (slot_idx = 0; slot_idx < 2; slot_idx++)
+	// ESFM feedback calculation takes a large number of clock cycles, so
+	// defer slot 0 generation to the end
+	// TODO: verify this behavior on real hardware
+	if (channel->slots[3].rhy_noise == 3)
 	{
-		esfm_slot *slot = &channel->slots[slot_idx];
-		ESFM_envelope_calc(slot);
-		ESFM_phase_generate_emu(slot);
-		if(slot_idx > 0)
-		{
-			ESFM_slot_generate_emu(slot);
-		}
+		ESFM_process_channel_noise3(channel);
+		return;
+	}
+	for (slot_idx = 1; slot_idx < 4; slot_idx++)
+	{
+		ESFM_slot_generate(&channel->slots[slot_idx]);
 	}
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+static ESFM_FORCE_INLINE void
+ESFM_process_channel_emu(esfm_channel *channel, const esfm_block_state *block_state,
+	const flag rhythm_mode)
+{
+	channel->output[0] = channel->output[1] = 0;
 	// ESFM feedback calculation takes a large number of clock cycles, so
 	// defer slot 0 generation to the end
 	// TODO: verify this behavior on real hardware
+	ESFM_slot_generate_emu(&channel->slots[1], block_state, rhythm_mode);
 }
 
 /* ------------------------------------------------------------------------- */
@@ -2061,12 +2490,41 @@ ESFM_clip_sample(int32 sample)
 	return (int16_t)sample;
 }
 
-#define TIMER1_CONST (0.2517482517482517)
-#define TIMER2_CONST (0.06293706293706293)
+/*
+ * Timers 1 and 2 tick every 80 and 320 microseconds, which is 36/143 and
+ * 9/143 of a tick per output sample. The accumulators count in 143rds of a
+ * tick, so the timers advance without any rounding drift.
+ */
+#define ESFM_TIMER_PERIOD 143
+static const uint8 timer_step[2] = { 36, 9 };
+
+/* ------------------------------------------------------------------------- */
+static inline uint8
+ESFM_eg_timer_lowest_bit(uint36 eg_timer)
+{
+	// Index of the lowest set bit in the low 13 bits, or 13 if there's none
+	uint16 low_bits = eg_timer & 0x1fff;
+	uint8 shift = 0;
+	if (low_bits == 0)
+	{
+		return 13;
+	}
+#if defined(__GNUC__) || defined(__clang__)
+	shift = __builtin_ctz(low_bits);
+#else
+	while ((low_bits & 1) == 0)
+	{
+		low_bits >>= 1;
+		shift++;
+	}
+#endif
+	return shift;
+}
+
 /* ------------------------------------------------------------------------- */
 static void
 ESFM_update_timers(esfm_chip *chip)
-{	
+{
 	int i;
 	// Tremolo
 	if ((chip->global_timer & 0x3f) == 0x3f)
@@ -2094,12 +2552,7 @@ ESFM_update_timers(esfm_chip *chip)
 	chip->eg_clocks = 0;
 	if (chip->eg_timer)
 	{
-		uint8 shift = 0;
-		while (shift < 36 && ((chip->eg_timer >> shift) & 1) == 0)
-		{
-			shift++;
-		}
-
+		uint8 shift = ESFM_eg_timer_lowest_bit(chip->eg_timer);
 		if (shift <= 12)
 		{
 			chip->eg_clocks = shift + 1;
@@ -2124,10 +2577,10 @@ ESFM_update_timers(esfm_chip *chip)
 	{
 		if (chip->timer_enable[i])
 		{
-			chip->timer_accumulator[i] += (i == 0) ? TIMER1_CONST : TIMER2_CONST;
-			if (chip->timer_accumulator[i] > 1.0)
+			chip->timer_accumulator[i] += timer_step[i];
+			if (chip->timer_accumulator[i] > ESFM_TIMER_PERIOD)
 			{
-				chip->timer_accumulator[i] -= 1.0;
+				chip->timer_accumulator[i] -= ESFM_TIMER_PERIOD;
 				chip->timer_counter[i]++;
 				if (chip->timer_counter[i] == 0)
 				{
@@ -2145,159 +2598,852 @@ ESFM_update_timers(esfm_chip *chip)
 	chip->eg_tick ^= 1;
 }
 
-#define KEY_ON_REGS_START (18 * 4 * 8)
 /* ------------------------------------------------------------------------- */
-int
-ESFM_reg_write_chan_idx(esfm_chip *chip, uint16_t reg)
+uint32_t
+ESFM_samples_until_irq(const esfm_chip *chip)
 {
-	int which_reg = -1;
-	if (chip->native_mode)
+	uint64_t samples = ESFM_NO_IRQ;
+	int i;
+
+	for (i = 0; i < 2; i++)
 	{
-		bool is_key_on_reg = reg >= KEY_ON_REGS_START && reg < (KEY_ON_REGS_START + 20);
-		if (is_key_on_reg)
+		// The counter overflows on its (256 - counter)th tick, which happens
+		// once the accumulator has gone past that many periods
+		uint64_t ticks, samples_to_overflow;
+		if (!chip->timer_enable[i] || chip->timer_mask[i])
 		{
-			which_reg = reg - KEY_ON_REGS_START;
+			continue;
 		}
-	}
-	else
-	{
-		uint8_t reg_low = reg & 0xff;
-		bool high = reg & 0x100;
-		bool is_key_on_reg = reg_low >= 0xb0 && reg_low < 0xb9;
-		if (is_key_on_reg)
+		ticks = 256 - chip->timer_counter[i];
+		samples_to_overflow = (ticks * ESFM_TIMER_PERIOD + 1 - chip->timer_accumulator[i]
+			+ timer_step[i] - 1) / timer_step[i];
+		if (samples_to_overflow < samples)
 		{
-			which_reg = (reg_low & 0x0f) + high * 9;
+			samples = samples_to_overflow;
 		}
 	}
-
-	return which_reg;
+	return (uint32_t)samples;
 }
 
 /* ------------------------------------------------------------------------- */
-void
-ESFM_update_write_buffer(esfm_chip *chip)
+static void
+ESFM_advance_timers(esfm_chip *chip, uint32_t num_samples)
 {
-	esfm_write_buf *write_buf;
-	bool note_off_written[20];
-	bool bassdrum_written = false;
+	// Same as num_samples calls to ESFM_update_timers, in closed form. The
+	// last one is still done the regular way, since it sets eg_clocks.
+	uint64_t count;
 	int i;
-	for (i = 0; i < 20; i++)
+
+	if (num_samples == 0)
 	{
-		note_off_written[i] = false;
+		return;
 	}
-	while((write_buf = &chip->write_buf[chip->write_buf_start]),
-		write_buf->valid && write_buf->timestamp <= chip->write_buf_timestamp)
+	if (chip->eg_timer_overflow || chip->eg_timer >= (1llu << 36) - 1 - num_samples)
 	{
-		int is_which_note_on_reg =
-			ESFM_reg_write_chan_idx(chip, write_buf->address);
-		if (is_which_note_on_reg >= 0)
+		// The envelope timer is about to wrap around (or just did), which
+		// throws off its every-other-sample count
+		while (num_samples-- > 0)
 		{
-			if ((chip->native_mode && (write_buf->data & 0x01) == 0)
-				|| (!chip->native_mode && (write_buf->data & 0x20) == 0)
-			)
-			{
-				// this is a note off command; note down that we got note off for this channel
-				note_off_written[is_which_note_on_reg] = true;
-			}
-			else
-			{
-				// this is a note on command; have we gotten a note off for this channel in this cycle?
-				if (note_off_written[is_which_note_on_reg])
-				{
-					// we have a conflict; let the note off be processed first and defer the
-					// rest of the buffer to the next cycle
-					break;
-				}
-			}
+			ESFM_update_timers(chip);
 		}
-		if ((chip->native_mode && write_buf->address == 0x4bd)
-			|| (!chip->native_mode && (write_buf->address & 0xff) == 0xbd)
-		)
+		return;
+	}
+	num_samples--;
+
+	count = (chip->global_timer + num_samples) / 0x40 - chip->global_timer / 0x40;
+	if (count > 0)
+	{
+		chip->tremolo_pos = (uint8)((chip->tremolo_pos + count) % 210);
+		chip->tremolo = chip->tremolo_pos < 105 ? chip->tremolo_pos : 210 - chip->tremolo_pos;
+	}
+	count = (chip->global_timer + num_samples) / 0x400 - chip->global_timer / 0x400;
+	chip->vibrato_pos = (uint8)((chip->vibrato_pos + count) & 0x07);
+	chip->global_timer = (chip->global_timer + num_samples) & 0x3ff;
+
+	chip->eg_timer += (num_samples + chip->eg_tick) / 2;
+	chip->eg_tick ^= num_samples & 1;
+
+	for (i = 0; i < 2; i++)
+	{
+		// The accumulator ticks whenever it goes past a period, and it never
+		// gains more than one by the sample, so it ends up between 1 and a
+		// full period after its last tick
+		uint64_t accumulator, ticks, ticks_to_overflow;
+		if (!chip->timer_enable[i])
 		{
-			// bassdrum register write (rhythm mode note-on/off control)
-			// have we already written to the bassdrum register in this cycle
-			if (bassdrum_written) {
-				// we have a conflict
-				break;
-			}
-			bassdrum_written = true;
+			continue;
 		}
-
-		write_buf->valid = 0;
-		ESFM_write_reg(chip, write_buf->address, write_buf->data);
-		chip->write_buf_start = (chip->write_buf_start + 1) % ESFM_WRITEBUF_SIZE;
+		accumulator = chip->timer_accumulator[i] + (uint64_t)num_samples * timer_step[i];
+		ticks = accumulator > 0 ? (accumulator - 1) / ESFM_TIMER_PERIOD : 0;
+		chip->timer_accumulator[i] = (uint8)(accumulator - ticks * ESFM_TIMER_PERIOD);
+		ticks_to_overflow = 256 - chip->timer_counter[i];
+		if (ticks < ticks_to_overflow)
+		{
+			chip->timer_counter[i] += (uint8)ticks;
+			continue;
+		}
+		if (chip->timer_mask[i] == 0)
+		{
+			chip->irq_bit = true;
+			chip->timer_overflow[i] = true;
+		}
+		chip->timer_counter[i] = chip->timer_reload[i]
+			+ (uint8)((ticks - ticks_to_overflow) % (256 - chip->timer_reload[i]));
 	}
 
-	chip->write_buf_timestamp++;
+	ESFM_update_timers(chip);
 }
 
 /* ------------------------------------------------------------------------- */
-void
-ESFM_generate(esfm_chip *chip, int16_t *buf)
+static flag
+ESFM_slots_idle(const esfm_chip *chip)
 {
+	// With every envelope released all the way and its key off, all the
+	// slots stay silent until a register write. Emulation mode leaves slots
+	// 2 and 3 alone, whatever state they were left in.
+	uint4 slots_mask = ESFM_NATIVE_MODE(chip) ? 0x0f : 0x03;
 	int channel_idx;
 
-	chip->output_accm[0] = chip->output_accm[1] = 0;
 	for (channel_idx = 0; channel_idx < 18; channel_idx++)
 	{
-		esfm_channel *channel = &chip->channels[channel_idx];
-		if (chip->native_mode)
-		{
-			ESFM_process_channel(channel);
-		}
-		else
+		if (chip->channels[channel_idx].slots_active & slots_mask)
 		{
-			ESFM_process_channel_emu(channel);
+			return 0;
 		}
 	}
-	ESFM_process_feedback(chip);
-	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	return 1;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_advance_idle(esfm_chip *chip, uint32_t num_samples)
+{
+	// Advances an idle chip by num_samples in closed form. Only the phase
+	// accumulators, the LFSR and the timers move; what's derived from them
+	// every sample (phase_out, eg_output, the rhythm bits) is left for the
+	// regular samples that have to follow.
+	esfm_slot_state *state = &chip->slot_state;
+	int num_slots = ESFM_NATIVE_MODE(chip) ? ESFM_CHANNEL_SLOTS : 2;
+	uint32_t samples_left = num_samples;
+	int channel_idx, slot_idx;
+	ESFM_STATS_ADD(chip, samples, num_samples);
+
+	while (samples_left > 0)
 	{
-		esfm_channel *channel = &chip->channels[channel_idx];
-		if (chip->native_mode)
+		// The phase increments stay the same until the vibrato position
+		// moves, at the end of the sample where global_timer is 0x3ff
+		uint32_t segment = 0x400 - chip->global_timer;
+		if (segment > samples_left)
 		{
-			ESFM_slot_generate(&channel->slots[0]);
+			segment = samples_left;
 		}
-		else
+		if (chip->phase_inc_vibrato_pos != chip->vibrato_pos)
 		{
-			ESFM_slot_generate_emu(&channel->slots[0]);
+			ESFM_update_phase_increments(chip);
 		}
-		chip->output_accm[0] += channel->output[0];
-		chip->output_accm[1] += channel->output[1];
+		for (channel_idx = 0; channel_idx < 18; channel_idx++)
+		{
+			for (slot_idx = 0; slot_idx < num_slots; slot_idx++)
+			{
+				int idx = channel_idx * ESFM_CHANNEL_SLOTS + slot_idx;
+				uint64_t phase_acc = state->phase_reset[idx] ? 0
+					: state->phase_acc[idx] + (uint64_t)(segment - 1) * state->phase_inc[idx];
+				state->phase_acc[idx] = (uint19)((phase_acc + state->phase_inc[idx]) & ((1 << 19) - 1));
+			}
+		}
+		ESFM_advance_timers(chip, segment);
+		samples_left -= segment;
 	}
-
-	buf[0] = ESFM_clip_sample(chip->output_accm[0]);
-	buf[1] = ESFM_clip_sample(chip->output_accm[1]);
-
-	ESFM_update_timers(chip);
-	ESFM_update_write_buffer(chip);
+	ESFM_lfsr_jump(chip, num_samples, num_slots * 18);
 }
 
 /* ------------------------------------------------------------------------- */
-int16_t
-ESFM_get_channel_output_native(esfm_chip *chip, int channel_idx)
+int
+ESFM_is_silent(const esfm_chip *chip)
 {
-	int16_t result;
-	int32_t temp_mix = 0;
-	int i;
-	
-	if (channel_idx < 0 || channel_idx >= 18)
+	if (chip->write_buf_size > 0
+		&& ESFM_QUEUE_LOAD(&chip->write_buf[chip->write_buf_start].valid))
 	{
 		return 0;
 	}
-	
-	for (i = 0; i < 4; i++)
+	return ESFM_slots_idle(chip) && ESFM_samples_until_irq(chip) == ESFM_NO_IRQ;
+}
+
+#define KEY_ON_REGS_START (18 * 4 * 8)
+/* ------------------------------------------------------------------------- */
+int
+ESFM_reg_write_chan_idx(esfm_chip *chip, uint16_t reg)
+{
+	int which_reg = -1;
+	if (ESFM_NATIVE_MODE(chip))
 	{
-		esfm_slot *slot = &chip->channels[channel_idx].slots[i];
-		
-		if (slot->output_level)
+		bool is_key_on_reg = reg >= KEY_ON_REGS_START && reg < (KEY_ON_REGS_START + 20);
+		if (is_key_on_reg)
 		{
-			int13 output_value = slot->in.output >> (7 - slot->output_level);
-			temp_mix += output_value & slot->out_enable[0];
-			temp_mix += output_value & slot->out_enable[1];
+			which_reg = reg - KEY_ON_REGS_START;
 		}
 	}
-	
+	else
+	{
+		uint8_t reg_low = reg & 0xff;
+		bool high = reg & 0x100;
+		bool is_key_on_reg = reg_low >= 0xb0 && reg_low < 0xb9;
+		if (is_key_on_reg)
+		{
+			which_reg = (reg_low & 0x0f) + high * 9;
+		}
+	}
+
+	return which_reg;
+}
+
+/*
+ * Tracks the key-on and bass drum register writes that were done in the
+ * current sample, since only one of each per channel/register can be
+ * processed before the next sample without clobbering the previous one.
+ */
+typedef struct _esfm_write_conflicts
+{
+	bool note_off_written[20];
+	bool bassdrum_written;
+
+} esfm_write_conflicts;
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_write_conflicts_reset(esfm_write_conflicts *conflicts)
+{
+	int i;
+	for (i = 0; i < 20; i++)
+	{
+		conflicts->note_off_written[i] = false;
+	}
+	conflicts->bassdrum_written = false;
+}
+
+/* ------------------------------------------------------------------------- */
+static bool
+ESFM_write_conflicts_check(esfm_chip *chip, esfm_write_conflicts *conflicts,
+	uint16_t address, uint8_t data)
+{
+	// Returns true if the write must be deferred to the next sample; otherwise
+	// notes it down, assuming that it's going to get written right away
+	int is_which_note_on_reg = ESFM_reg_write_chan_idx(chip, address);
+	if (is_which_note_on_reg >= 0)
+	{
+		if ((ESFM_NATIVE_MODE(chip) && (data & 0x01) == 0)
+			|| (!ESFM_NATIVE_MODE(chip) && (data & 0x20) == 0)
+		)
+		{
+			// this is a note off command; note down that we got note off for this channel
+			conflicts->note_off_written[is_which_note_on_reg] = true;
+		}
+		else
+		{
+			// this is a note on command; have we gotten a note off for this channel in this cycle?
+			if (conflicts->note_off_written[is_which_note_on_reg])
+			{
+				// we have a conflict; let the note off be processed first and defer the
+				// rest of the buffer to the next cycle
+				ESFM_STATS_ADD(chip, deferred_key_on_writes, 1);
+				return true;
+			}
+		}
+	}
+	if ((ESFM_NATIVE_MODE(chip) && address == 0x4bd)
+		|| (!ESFM_NATIVE_MODE(chip) && (address & 0xff) == 0xbd)
+	)
+	{
+		// bassdrum register write (rhythm mode note-on/off control)
+		// have we already written to the bassdrum register in this cycle
+		if (conflicts->bassdrum_written) {
+			// we have a conflict
+			ESFM_STATS_ADD(chip, deferred_bassdrum_writes, 1);
+			return true;
+		}
+		conflicts->bassdrum_written = true;
+	}
+	return false;
+}
+
+/* ------------------------------------------------------------------------- */
+static bool
+ESFM_port_write_reg_address(const esfm_chip *chip, uint8_t offset, uint16_t *address)
+{
+	// Register that a write to the given port would go to, if any; mirrors
+	// ESFM_write_port
+	if (ESFM_NATIVE_MODE(chip) ? offset == 1 : (offset == 1 || offset == 3))
+	{
+		*address = chip->addr_latch;
+		return true;
+	}
+	return false;
+}
+
+/* ------------------------------------------------------------------------- */
+static bool
+ESFM_write_unless_conflicting(esfm_chip *chip, esfm_write_conflicts *conflicts,
+	uint16_t address, uint8_t data)
+{
+	// Applies a register write, or a port write if ESFM_QUEUE_PORT_WRITE is
+	// set; returns true instead if it has to be deferred to the next sample
+	if (address & ESFM_QUEUE_PORT_WRITE)
+	{
+		uint8_t offset = address & 0x03;
+		// Only writes to a data port reach a register
+		if (ESFM_port_write_reg_address(chip, offset, &address)
+			&& ESFM_write_conflicts_check(chip, conflicts, address, data))
+		{
+			return true;
+		}
+		ESFM_write_port(chip, offset, data);
+	}
+	else
+	{
+		if (ESFM_write_conflicts_check(chip, conflicts, address, data))
+		{
+			return true;
+		}
+		ESFM_write_reg(chip, address, data);
+	}
+	return false;
+}
+
+#ifdef _ESFMU_ENABLE_STATS
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_update_write_buf_high_water(esfm_chip *chip)
+{
+	// Counted here on the rendering thread, which owns write_buf_start and the
+	// stats; the queue only grows between drains, so this catches its peak
+	size_t end, num_pending;
+
+	if (chip->write_buf_size == 0
+		|| !ESFM_QUEUE_LOAD(&chip->write_buf[chip->write_buf_start].valid))
+	{
+		return;
+	}
+	end = ESFM_QUEUE_LOAD(&chip->write_buf_end);
+	num_pending = (end + chip->write_buf_size - chip->write_buf_start) % chip->write_buf_size;
+	if (num_pending == 0)
+	{
+		// Not empty, since the oldest entry is still there
+		num_pending = chip->write_buf_size;
+	}
+	if (num_pending > chip->stats.write_buf_high_water)
+	{
+		chip->stats.write_buf_high_water = num_pending;
+	}
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+static bool
+ESFM_drain_write_buffer(esfm_chip *chip, esfm_write_conflicts *conflicts)
+{
+	// Processes all buffered writes that are due; returns true if any of them
+	// had to be deferred to the next sample
+	esfm_write_buf *write_buf;
+	bool deferred = false;
+	ESFM_STATS_TIMER(stage_timer);
+
+#ifdef _ESFMU_ENABLE_STATS
+	ESFM_update_write_buf_high_water(chip);
+#endif
+	while(chip->write_buf_size > 0
+		&& ESFM_QUEUE_LOAD(&(write_buf = &chip->write_buf[chip->write_buf_start])->valid)
+		&& write_buf->timestamp <= chip->write_buf_timestamp)
+	{
+		if (ESFM_write_unless_conflicting(chip, conflicts, write_buf->address, write_buf->data))
+		{
+			deferred = true;
+			break;
+		}
+
+		// Hands the entry back to the producer
+		ESFM_QUEUE_STORE(&write_buf->valid, 0);
+		chip->write_buf_start = (chip->write_buf_start + 1) % chip->write_buf_size;
+	}
+	ESFM_STATS_LAP(chip, stage_timer, ESFM_STAGE_WRITE_BUFFER);
+	return deferred;
+}
+
+/* ------------------------------------------------------------------------- */
+static ESFM_FORCE_INLINE void
+ESFM_write_buf_advance(esfm_chip *chip, uint64_t num_samples)
+{
+	// Read by the queue producer from its own thread
+	ESFM_QUEUE_STORE(&chip->write_buf_timestamp, chip->write_buf_timestamp + num_samples);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ESFM_update_write_buffer(esfm_chip *chip)
+{
+	esfm_write_conflicts conflicts;
+
+	ESFM_write_conflicts_reset(&conflicts);
+	ESFM_drain_write_buffer(chip, &conflicts);
+	ESFM_write_buf_advance(chip, 1);
+}
+
+/* ------------------------------------------------------------------------- */
+static uint32_t
+ESFM_apply_reg_events(esfm_chip *chip, esfm_write_conflicts *conflicts,
+	const esfm_reg_event *events, uint32_t num_events, uint32_t event_idx,
+	uint32_t sample_pos)
+{
+	// Writes the events due at or before sample_pos, in order, stopping at
+	// the first one that conflicts; returns the index of the next pending one
+	while (event_idx < num_events && events[event_idx].sample_offset <= sample_pos)
+	{
+		const esfm_reg_event *event = &events[event_idx];
+		if (ESFM_write_unless_conflicting(chip, conflicts, event->address, event->data))
+		{
+			break;
+		}
+		event_idx++;
+	}
+	return event_idx;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_update_slot_envelope_params(esfm_chip *chip, esfm_slot *slot)
+{
+	esfm_slot_state *state = &chip->slot_state;
+	uint7 idx = slot->state_idx;
+	flag tremolo_deep = ESFM_NATIVE_MODE(chip) ? slot->tremolo_deep : chip->emu_tremolo_deep;
+
+	state->eg_level_offset[idx] = (slot->t_level << 2)
+		+ (slot->in.eg_ksl_offset >> kslshift[slot->ksl]);
+	// A shift of 8 always gives 0, since the tremolo value stays below 256
+	state->eg_tremolo_shift[idx] = slot->tremolo_en ? (!tremolo_deep << 1) + 2 : 8;
+	state->eg_rate_keyscale[idx] = slot->in.keyscale >> ((!slot->ksr) << 1);
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_update_stale_slot_params(esfm_chip *chip)
+{
+	// Recomputes the derived values of the slots marked in slot_params_stale
+	int word, bit;
+
+	for (word = 0; word < (18 * ESFM_CHANNEL_SLOTS + 31) / 32; word++)
+	{
+		uint32 stale = chip->slot_params_stale[word];
+		if (stale == 0)
+		{
+			continue;
+		}
+		chip->slot_params_stale[word] = 0;
+		for (bit = 0; bit < 32 && word * 32 + bit < 18 * ESFM_CHANNEL_SLOTS; bit++)
+		{
+			int idx = word * 32 + bit;
+			esfm_slot *slot;
+			if (!((stale >> bit) & 1))
+			{
+				continue;
+			}
+			slot = &chip->channels[idx / ESFM_CHANNEL_SLOTS].slots[idx % ESFM_CHANNEL_SLOTS];
+			ESFM_update_slot_phase_increment(chip, slot);
+			ESFM_update_slot_envelope_params(chip, slot);
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_prepare_block(esfm_chip *chip, esfm_block_state *block_state)
+{
+	int channel_idx;
+
+	block_state->num_feedback = 0;
+#ifdef ESFM_FEEDBACK_AVX2
+	block_state->feedback_avx2 = __builtin_cpu_supports("avx2") != 0;
+#else
+	block_state->feedback_avx2 = 0;
+#endif
+	block_state->feedback_iterations = chip->preview.enabled ? chip->preview.feedback_iterations : 29;
+	block_state->emu_waveform_mask = chip->emu_newmode != 0 ? 0x07 : 0x03;
+	block_state->emu_rhythm_mode = (chip->emu_rhy_mode_flags & 0x20) != 0;
+	ESFM_update_stale_slot_params(chip);
+
+	if (!ESFM_NATIVE_MODE(chip))
+	{
+		for (channel_idx = 0; channel_idx < 18; channel_idx++)
+		{
+			esfm_channel *channel = &chip->channels[channel_idx];
+			int pair_primary_idx = emu_4op_secondary_to_primary[channel_idx];
+			const flag **key_on = &block_state->emu_key_on[channel_idx * 2];
+
+			key_on[0] = channel->slots[0].in.key_on;
+			key_on[1] = channel->slots[1].in.key_on;
+			if (pair_primary_idx >= 0)
+			{
+				esfm_channel *pair_primary = &chip->channels[pair_primary_idx];
+				if (pair_primary->emu_mode_4op_enable)
+				{
+					key_on[0] = key_on[1] = pair_primary->slots[0].in.key_on;
+				}
+			}
+			else if (channel_idx == 7 || channel_idx == 8)
+			{
+				key_on[1] = &channel->key_on_2;
+			}
+		}
+	}
+
+	block_state->num_rhythm_slots = 0;
+#ifndef _ESFMU_EMU_ONLY
+	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	{
+		esfm_slot *slot = &chip->channels[channel_idx].slots[3];
+		if (chip->native_mode && slot->rhy_noise)
+		{
+			block_state->rhythm_slots[block_state->num_rhythm_slots++] = slot;
+		}
+	}
+#endif
+
+	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	{
+		esfm_slot *slot = &chip->channels[channel_idx].slots[0];
+		esfm_feedback_setup *setup;
+		uint32 basefreq;
+
+		if (!slot->mod_in_level
+			|| (!ESFM_NATIVE_MODE(chip) && slot->in.mod_input != &slot->in.feedback_buf))
+		{
+			continue;
+		}
+
+		setup = &block_state->feedback[block_state->num_feedback++];
+		setup->slot = slot;
+		basefreq = (slot->f_num << slot->block) >> 1;
+		setup->phase_offset = (basefreq * mt[slot->mult]) >> 1;
+		setup->mod_in_shift = 7 - slot->mod_in_level;
+		if (ESFM_NATIVE_MODE(chip))
+		{
+			setup->waveform = slot->waveform;
+			setup->out_shift = 0;
+		}
+		else
+		{
+			setup->waveform = slot->waveform & block_state->emu_waveform_mask;
+			setup->out_shift = setup->mod_in_shift;
+		}
+	}
+}
+
+#ifndef _ESFMU_EMU_ONLY
+/* ------------------------------------------------------------------------- */
+static inline void
+ESFM_generate_native_front(esfm_chip *chip, esfm_block_state *block_state)
+{
+	int channel_idx;
+	ESFM_STATS_TIMER(stage_timer);
+
+	chip->output_accm[0] = chip->output_accm[1] = 0;
+	ESFM_process_envelopes_native(chip);
+	ESFM_STATS_LAP(chip, stage_timer, ESFM_STAGE_ENVELOPE);
+	ESFM_process_phases(chip, block_state);
+	ESFM_STATS_LAP(chip, stage_timer, ESFM_STAGE_PHASE);
+	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	{
+		ESFM_process_channel(&chip->channels[channel_idx]);
+	}
+	ESFM_STATS_LAP(chip, stage_timer, ESFM_STAGE_SLOT_OUTPUT);
+}
+
+/* ------------------------------------------------------------------------- */
+static inline void
+ESFM_generate_native_back(esfm_chip *chip)
+{
+	int channel_idx;
+	ESFM_STATS_TIMER(stage_timer);
+
+	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	{
+		esfm_channel *channel = &chip->channels[channel_idx];
+		ESFM_slot_generate(&channel->slots[0]);
+		chip->output_accm[0] += channel->output[0];
+		chip->output_accm[1] += channel->output[1];
+	}
+	ESFM_STATS_LAP(chip, stage_timer, ESFM_STAGE_SLOT_OUTPUT);
+	ESFM_update_timers(chip);
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+static ESFM_FORCE_INLINE void
+ESFM_generate_emu_front(esfm_chip *chip, esfm_block_state *block_state, const flag rhythm_mode)
+{
+	int channel_idx;
+	ESFM_STATS_TIMER(stage_timer);
+
+	chip->output_accm[0] = chip->output_accm[1] = 0;
+	ESFM_process_envelopes_emu(chip, block_state);
+	ESFM_STATS_LAP(chip, stage_timer, ESFM_STAGE_ENVELOPE);
+	ESFM_process_phases_emu(chip, rhythm_mode);
+	ESFM_STATS_LAP(chip, stage_timer, ESFM_STAGE_PHASE);
+	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	{
+		ESFM_process_channel_emu(&chip->channels[channel_idx], block_state, rhythm_mode);
+	}
+	ESFM_STATS_LAP(chip, stage_timer, ESFM_STAGE_SLOT_OUTPUT);
+}
+
+/* ------------------------------------------------------------------------- */
+static ESFM_FORCE_INLINE void
+ESFM_generate_emu_back(esfm_chip *chip, const esfm_block_state *block_state,
+	const flag rhythm_mode)
+{
+	int channel_idx;
+	ESFM_STATS_TIMER(stage_timer);
+
+	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	{
+		esfm_channel *channel = &chip->channels[channel_idx];
+		ESFM_slot_generate_emu(&channel->slots[0], block_state, rhythm_mode);
+		chip->output_accm[0] += channel->output[0];
+		chip->output_accm[1] += channel->output[1];
+	}
+	ESFM_STATS_LAP(chip, stage_timer, ESFM_STAGE_SLOT_OUTPUT);
+	ESFM_update_timers(chip);
+}
+
+#ifndef _ESFMU_EMU_ONLY
+/* ------------------------------------------------------------------------- */
+static inline void
+ESFM_generate_native(esfm_chip *chip, esfm_block_state *block_state)
+{
+	// Slot 0 generation is split off from the rest of the sample, since it
+	// has to wait for the feedback stage
+	ESFM_generate_native_front(chip, block_state);
+	ESFM_process_feedback(chip, block_state);
+	ESFM_generate_native_back(chip);
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+static ESFM_FORCE_INLINE void
+ESFM_generate_emu(esfm_chip *chip, esfm_block_state *block_state, const flag rhythm_mode)
+{
+	ESFM_generate_emu_front(chip, block_state, rhythm_mode);
+	ESFM_process_feedback(chip, block_state);
+	ESFM_generate_emu_back(chip, block_state, rhythm_mode);
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_process_envelopes_preview(esfm_chip *chip, const esfm_block_state *block_state)
+{
+	// Only runs the envelopes once every 2^envelope_shift samples, holding
+	// their output in between
+	esfm_preview *preview = &chip->preview;
+	esfm_eg_clock clock;
+	uint32 eg_timer;
+	int channel_idx, slot_idx;
+	ESFM_STATS_ADD(chip, samples, 1);
+
+	if (preview->envelope_wait > 0)
+	{
+		// Phase resets on key-on still only last one sample
+		if (preview->envelope_wait == (1 << preview->envelope_shift) - 1)
+		{
+			memset(chip->slot_state.phase_reset, 0, sizeof(chip->slot_state.phase_reset));
+		}
+		preview->envelope_wait--;
+		return;
+	}
+	preview->envelope_wait = (1 << preview->envelope_shift) - 1;
+
+	// Same sequence as ESFM_update_timers produces, one step per update
+	eg_timer = preview->eg_counter >> 1;
+	clock.clocks = 0;
+	if (eg_timer && ESFM_eg_timer_lowest_bit(eg_timer) <= 12)
+	{
+		clock.clocks = ESFM_eg_timer_lowest_bit(eg_timer) + 1;
+	}
+	clock.tick = preview->eg_counter & 1;
+	clock.step = preview->eg_counter & 0x03;
+	preview->eg_counter++;
+
+	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	{
+		esfm_channel *channel = &chip->channels[channel_idx];
+		for (slot_idx = 0; slot_idx < (ESFM_NATIVE_MODE(chip) ? 4 : 2); slot_idx++)
+		{
+			esfm_slot *slot = &channel->slots[slot_idx];
+			if (!(channel->slots_active & (1 << slot_idx)))
+			{
+				ESFM_envelope_update_output(slot);
+			}
+			else if (ESFM_NATIVE_MODE(chip))
+			{
+				ESFM_STATS_ADD(chip, active_slots, 1);
+				ESFM_envelope_calc(slot, *slot->in.key_on, &clock, 1, preview->envelope_shift);
+			}
+			else
+			{
+				ESFM_STATS_ADD(chip, active_slots, 1);
+				ESFM_envelope_calc(slot, *block_state->emu_key_on[channel_idx * 2 + slot_idx],
+					&clock, 0, preview->envelope_shift);
+			}
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_generate_preview(esfm_chip *chip, esfm_block_state *block_state)
+{
+	// Advances the chip by preview.decimation samples, only generating the
+	// waveforms for the last one
+	const flag rhythm_mode = block_state->emu_rhythm_mode;
+	uint8 sample_idx;
+	int channel_idx;
+
+	for (sample_idx = 1; sample_idx < chip->preview.decimation; sample_idx++)
+	{
+		ESFM_process_envelopes_preview(chip, block_state);
+#ifndef _ESFMU_EMU_ONLY
+		if (chip->native_mode)
+		{
+			ESFM_process_phases(chip, block_state);
+		}
+		else
+#endif
+		{
+			ESFM_process_phases_emu(chip, rhythm_mode);
+		}
+		ESFM_update_timers(chip);
+	}
+
+	chip->output_accm[0] = chip->output_accm[1] = 0;
+	ESFM_process_envelopes_preview(chip, block_state);
+#ifndef _ESFMU_EMU_ONLY
+	if (chip->native_mode)
+	{
+		ESFM_process_phases(chip, block_state);
+		for (channel_idx = 0; channel_idx < 18; channel_idx++)
+		{
+			ESFM_process_channel(&chip->channels[channel_idx]);
+		}
+		ESFM_process_feedback(chip, block_state);
+		ESFM_generate_native_back(chip);
+	}
+	else
+#endif
+	if (chip->preview.decimation == 1)
+	{
+		ESFM_process_phases_emu(chip, rhythm_mode);
+		for (channel_idx = 0; channel_idx < 18; channel_idx++)
+		{
+			ESFM_process_channel_emu(&chip->channels[channel_idx], block_state, rhythm_mode);
+		}
+		ESFM_process_feedback(chip, block_state);
+		ESFM_generate_emu_back(chip, block_state, rhythm_mode);
+	}
+	else
+	{
+		// Slot 1 normally gets modulated by slot 0's output from the previous
+		// sample, which would be decimation samples old by now; generating
+		// slot 0 first keeps the timbre much closer
+		ESFM_process_phases_emu(chip, rhythm_mode);
+		ESFM_process_feedback(chip, block_state);
+		for (channel_idx = 0; channel_idx < 18; channel_idx++)
+		{
+			esfm_channel *channel = &chip->channels[channel_idx];
+			channel->output[0] = channel->output[1] = 0;
+			ESFM_slot_generate_emu(&channel->slots[0], block_state, rhythm_mode);
+			ESFM_slot_generate_emu(&channel->slots[1], block_state, rhythm_mode);
+			chip->output_accm[0] += channel->output[0];
+			chip->output_accm[1] += channel->output[1];
+		}
+		ESFM_update_timers(chip);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static uint32_t
+ESFM_write_buffer_run_length(esfm_chip *chip, uint32_t max_samples)
+{
+	// Number of samples that can be generated before a buffered write is due
+	// (the due write is processed right after the last of those samples)
+	const esfm_write_buf *write_buf;
+	uint64_t samples_until_due;
+
+	if (chip->write_buf_size == 0)
+	{
+		return max_samples;
+	}
+	write_buf = &chip->write_buf[chip->write_buf_start];
+	if (!ESFM_QUEUE_LOAD(&write_buf->valid))
+	{
+		return max_samples;
+	}
+	if (write_buf->timestamp <= chip->write_buf_timestamp)
+	{
+		return 1;
+	}
+	samples_until_due = write_buf->timestamp - chip->write_buf_timestamp + 1;
+	return samples_until_due < max_samples ? (uint32_t)samples_until_due : max_samples;
+}
+
+/* ------------------------------------------------------------------------- */
+static uint32_t
+ESFM_output_run_length(esfm_chip *chip, uint32_t max_samples, uint32_t decimation)
+{
+	// Same as ESFM_write_buffer_run_length, but in output samples, which each
+	// advance the chip by decimation samples; a write that comes due partway
+	// through an output sample is processed after it
+	uint64_t chip_samples = (uint64_t)max_samples * decimation;
+	uint64_t run_length;
+
+	if (decimation == 1)
+	{
+		return ESFM_write_buffer_run_length(chip, max_samples);
+	}
+	run_length = ESFM_write_buffer_run_length(chip,
+		chip_samples < UINT32_MAX ? (uint32_t)chip_samples : UINT32_MAX);
+	run_length = (run_length + decimation - 1) / decimation;
+	return run_length < max_samples ? (uint32_t)run_length : max_samples;
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ESFM_generate(esfm_chip *chip, int16_t *buf)
+{
+	ESFM_generate_stream(chip, buf, 1);
+}
+
+/* ------------------------------------------------------------------------- */
+int16_t
+ESFM_get_channel_output_native(esfm_chip *chip, int channel_idx)
+{
+	int16_t result;
+	int32_t temp_mix = 0;
+	int i;
+	
+	if (channel_idx < 0 || channel_idx >= 18)
+	{
+		return 0;
+	}
+	
+	for (i = 0; i < ESFM_CHANNEL_SLOTS; i++)
+	{
+		esfm_slot *slot = &chip->channels[channel_idx].slots[i];
+		
+		if (slot->output_level)
+		{
+			int13 output_value = chip->slot_state.output[slot->state_idx] >> (7 - slot->output_level);
+			temp_mix += output_value & slot->out_enable[0];
+			temp_mix += output_value & slot->out_enable[1];
+		}
+	}
+	
 	if (temp_mix > 32767)
 	{
 		temp_mix = 32767;
@@ -2310,15 +3456,565 @@ ESFM_get_channel_output_native(esfm_chip *chip, int channel_idx)
 	return result;
 }
 
+/*
+ * Where and how ESFM_generate_render writes its output frames: sample n of
+ * each side goes to index (n * stride) of the left and right pointers, which
+ * point to arrays of the given format. The mix can be left out by setting
+ * left to NULL. Optionally, each channel's own output also gets written to
+ * the 18 buffers in channel_bufs, as int16 stereo frames or mono samples.
+ */
+typedef enum _esfm_output_format
+{
+	ESFM_OUTPUT_INT16,
+	ESFM_OUTPUT_INT32,
+	ESFM_OUTPUT_FLOAT
+
+} esfm_output_format;
+
+typedef struct _esfm_output
+{
+	esfm_output_format format;
+	void *left;
+	void *right;
+	size_t stride;
+	// Float output only
+	float gain;
+
+	int16_t *const *channel_bufs;
+	flag channel_stereo;
+
+} esfm_output;
+
+/* ------------------------------------------------------------------------- */
+static inline void
+ESFM_output_store(esfm_chip *chip, const esfm_output *output, size_t pos)
+{
+	size_t idx = pos * output->stride;
+
+	if (output->channel_bufs != NULL)
+	{
+		int channel_idx;
+		for (channel_idx = 0; channel_idx < 18; channel_idx++)
+		{
+			const esfm_channel *channel = &chip->channels[channel_idx];
+			int16_t *channel_buf = output->channel_bufs[channel_idx];
+			if (channel_buf == NULL)
+			{
+				continue;
+			}
+			if (output->channel_stereo)
+			{
+				channel_buf[pos * 2] = channel->output[0];
+				channel_buf[pos * 2 + 1] = channel->output[1];
+			}
+			else
+			{
+				channel_buf[pos] = ESFM_clip_sample((int32)channel->output[0] + channel->output[1]);
+			}
+		}
+	}
+
+	if (output->left == NULL)
+	{
+		return;
+	}
+	switch (output->format)
+	{
+		case ESFM_OUTPUT_INT16:
+			((int16_t *)output->left)[idx] = ESFM_clip_sample(chip->output_accm[0]);
+			((int16_t *)output->right)[idx] = ESFM_clip_sample(chip->output_accm[1]);
+			break;
+		case ESFM_OUTPUT_INT32:
+			((int32_t *)output->left)[idx] = chip->output_accm[0];
+			((int32_t *)output->right)[idx] = chip->output_accm[1];
+			break;
+		case ESFM_OUTPUT_FLOAT:
+			((float *)output->left)[idx] = (float)chip->output_accm[0] * output->gain;
+			((float *)output->right)[idx] = (float)chip->output_accm[1] * output->gain;
+			break;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static inline void
+ESFM_skip_sample(esfm_chip *chip, esfm_block_state *block_state, flag last_in_run)
+{
+	// Advances everything that carries over between samples, leaving out the
+	// wave generation. Emulation mode slots can keep using their last feedback
+	// value after their feedback stops running, so that's still computed at
+	// the end of each run, right before any register writes.
+#ifndef _ESFMU_EMU_ONLY
+	if (chip->native_mode)
+	{
+		ESFM_process_envelopes_native(chip);
+		ESFM_process_phases(chip, block_state);
+	}
+	else
+#endif
+	{
+		ESFM_process_envelopes_emu(chip, block_state);
+		ESFM_process_phases_emu(chip, block_state->emu_rhythm_mode);
+	}
+	if (last_in_run)
+	{
+		ESFM_process_feedback(chip, block_state);
+	}
+	ESFM_update_timers(chip);
+}
+
+/*
+ * An idle chip only needs a regular sample or two at the end of a run to be
+ * exactly where rendering it would have left it: the emulation mode hi-hat
+ * reads the top cymbal's rhythm bits from the sample before.
+ */
+#define ESFM_IDLE_FULL_SAMPLES 2
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_generate_idle(esfm_chip *chip, esfm_block_state *block_state, const esfm_output *output,
+	size_t pos, uint32_t run_length)
+{
+	// Renders a run of silence from an idle chip, skipping ahead over the
+	// run in closed form
+	esfm_slot_state *state = &chip->slot_state;
+	int num_slots = ESFM_NATIVE_MODE(chip) ? ESFM_CHANNEL_SLOTS : 2;
+	int channel_idx, slot_idx;
+	uint32_t i;
+
+	chip->output_accm[0] = chip->output_accm[1] = 0;
+	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	{
+		chip->channels[channel_idx].output[0] = chip->channels[channel_idx].output[1] = 0;
+		for (slot_idx = 0; slot_idx < num_slots; slot_idx++)
+		{
+			state->output[channel_idx * ESFM_CHANNEL_SLOTS + slot_idx] = 0;
+		}
+	}
+	ESFM_advance_idle(chip, run_length - ESFM_IDLE_FULL_SAMPLES);
+	for (i = ESFM_IDLE_FULL_SAMPLES; i > 0; i--)
+	{
+		ESFM_skip_sample(chip, block_state, i == 1);
+	}
+	for (i = 0; i < run_length; i++)
+	{
+		ESFM_output_store(chip, output, pos + i);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_generate_run(esfm_chip *chip, esfm_block_state *block_state, const esfm_output *output,
+	size_t pos, uint32_t run_length)
+{
+	// Renders a run of samples without register state changes, selecting the
+	// mode-specific kernel once for the whole run
+	uint32_t i;
+
+	ESFM_prepare_block(chip, block_state);
+	if (chip->preview.enabled)
+	{
+		for (i = 0; i < run_length; i++)
+		{
+			ESFM_generate_preview(chip, block_state);
+			ESFM_output_store(chip, output, pos + i);
+		}
+	}
+	else if (run_length > ESFM_IDLE_FULL_SAMPLES && ESFM_slots_idle(chip))
+	{
+		ESFM_generate_idle(chip, block_state, output, pos, run_length);
+	}
+#ifndef _ESFMU_EMU_ONLY
+	else if (chip->native_mode)
+	{
+		for (i = 0; i < run_length; i++)
+		{
+			ESFM_generate_native(chip, block_state);
+			ESFM_output_store(chip, output, pos + i);
+		}
+	}
+#endif
+	else if (block_state->emu_rhythm_mode)
+	{
+		for (i = 0; i < run_length; i++)
+		{
+			ESFM_generate_emu(chip, block_state, 1);
+			ESFM_output_store(chip, output, pos + i);
+		}
+	}
+	else
+	{
+		for (i = 0; i < run_length; i++)
+		{
+			ESFM_generate_emu(chip, block_state, 0);
+			ESFM_output_store(chip, output, pos + i);
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static uint32_t
+ESFM_generate_render(esfm_chip *chip, const esfm_output *output, uint32_t num_samples,
+	const esfm_reg_event *events, uint32_t num_events)
+{
+	esfm_block_state block_state;
+	esfm_write_conflicts conflicts;
+	uint32_t sample_pos = 0;
+	uint32_t decimation = chip->preview.enabled ? chip->preview.decimation : 1;
+	uint32_t event_idx;
+
+	// Events are written right before the sample at their offset, subject to
+	// the same conflict rules as the write buffer; an event that has to be
+	// deferred holds back the ones after it
+	ESFM_write_conflicts_reset(&conflicts);
+	event_idx = ESFM_apply_reg_events(chip, &conflicts, events, num_events, 0, 0);
+
+	while (sample_pos < num_samples)
+	{
+		// Register state only changes when the write buffer gets processed or
+		// an event is due, so split the stream into runs ending right before
+		// each of those
+		uint32_t run_length = ESFM_output_run_length(chip, num_samples - sample_pos, decimation);
+		if (event_idx < num_events)
+		{
+			uint32_t event_offset = events[event_idx].sample_offset;
+			uint32_t samples_until_event =
+				event_offset > sample_pos ? event_offset - sample_pos : 1;
+			if (samples_until_event < run_length)
+			{
+				run_length = samples_until_event;
+			}
+		}
+
+		ESFM_generate_run(chip, &block_state, output, sample_pos, run_length);
+		sample_pos += run_length;
+
+		ESFM_write_buf_advance(chip, (uint64_t)run_length * decimation - 1);
+		if (sample_pos < num_samples)
+		{
+			ESFM_write_conflicts_reset(&conflicts);
+			if (!ESFM_drain_write_buffer(chip, &conflicts))
+			{
+				event_idx = ESFM_apply_reg_events(chip, &conflicts, events, num_events,
+					event_idx, sample_pos);
+			}
+			ESFM_write_buf_advance(chip, 1);
+		}
+		else
+		{
+			ESFM_update_write_buffer(chip);
+		}
+	}
+
+	return event_idx;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_output_interleaved(esfm_output *output, esfm_output_format format, void *sndptr,
+	size_t sample_size)
+{
+	output->format = format;
+	output->left = sndptr;
+	output->right = sndptr != NULL ? (char *)sndptr + sample_size : NULL;
+	output->stride = 2;
+	output->gain = 1.0f;
+	output->channel_bufs = NULL;
+	output->channel_stereo = 0;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_output_planar(esfm_output *output, esfm_output_format format, void *left, void *right)
+{
+	output->format = format;
+	output->left = left;
+	output->right = right;
+	output->stride = 1;
+	output->gain = 1.0f;
+	output->channel_bufs = NULL;
+	output->channel_stereo = 0;
+}
+
 /* ------------------------------------------------------------------------- */
 void
 ESFM_generate_stream(esfm_chip *chip, int16_t *sndptr, uint32_t num_samples)
 {
-	uint32_t i;
+	esfm_output output;
+	ESFM_output_interleaved(&output, ESFM_OUTPUT_INT16, sndptr, sizeof(int16_t));
+	ESFM_generate_render(chip, &output, num_samples, NULL, 0);
+}
+
+/* ------------------------------------------------------------------------- */
+uint32_t
+ESFM_generate_stream_events(esfm_chip *chip, int16_t *sndptr, uint32_t num_samples,
+	const esfm_reg_event *events, uint32_t num_events)
+{
+	esfm_output output;
+	ESFM_output_interleaved(&output, ESFM_OUTPUT_INT16, sndptr, sizeof(int16_t));
+	return ESFM_generate_render(chip, &output, num_samples, events, num_events);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ESFM_generate_stream_int32(esfm_chip *chip, int32_t *sndptr, uint32_t num_samples)
+{
+	esfm_output output;
+	ESFM_output_interleaved(&output, ESFM_OUTPUT_INT32, sndptr, sizeof(int32_t));
+	ESFM_generate_render(chip, &output, num_samples, NULL, 0);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ESFM_generate_stream_int32_planar(esfm_chip *chip, int32_t *left, int32_t *right,
+	uint32_t num_samples)
+{
+	esfm_output output;
+	ESFM_output_planar(&output, ESFM_OUTPUT_INT32, left, right);
+	ESFM_generate_render(chip, &output, num_samples, NULL, 0);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ESFM_generate_stream_float(esfm_chip *chip, float *sndptr, uint32_t num_samples, float gain)
+{
+	esfm_output output;
+	ESFM_output_interleaved(&output, ESFM_OUTPUT_FLOAT, sndptr, sizeof(float));
+	output.gain = gain;
+	ESFM_generate_render(chip, &output, num_samples, NULL, 0);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ESFM_generate_stream_float_planar(esfm_chip *chip, float *left, float *right,
+	uint32_t num_samples, float gain)
+{
+	esfm_output output;
+	ESFM_output_planar(&output, ESFM_OUTPUT_FLOAT, left, right);
+	output.gain = gain;
+	ESFM_generate_render(chip, &output, num_samples, NULL, 0);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ESFM_generate_stream_channels(esfm_chip *chip, int16_t *sndptr, int16_t *const *channel_bufs,
+	int channel_stereo, uint32_t num_samples)
+{
+	esfm_output output;
+	ESFM_output_interleaved(&output, ESFM_OUTPUT_INT16, sndptr, sizeof(int16_t));
+	output.channel_bufs = channel_bufs;
+	output.channel_stereo = channel_stereo != 0;
+	ESFM_generate_render(chip, &output, num_samples, NULL, 0);
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_generate_batch_group(esfm_chip *const *chips, int16_t *const *sndptrs, size_t num_chips,
+	uint32_t num_samples)
+{
+	// Renders up to ESFM_BATCH_GROUP_SIZE chips in lockstep, sample by sample,
+	// so that the feedback chains of all of them can share the vector lanes
+	esfm_block_state block_states[ESFM_BATCH_GROUP_SIZE];
+	esfm_output outputs[ESFM_BATCH_GROUP_SIZE];
+	uint32_t sample_pos = 0;
+	size_t chip_idx;
+
+	for (chip_idx = 0; chip_idx < num_chips; chip_idx++)
+	{
+		ESFM_output_interleaved(&outputs[chip_idx], ESFM_OUTPUT_INT16, sndptrs[chip_idx],
+			sizeof(int16_t));
+	}
+
+	while (sample_pos < num_samples)
+	{
+		// Each run has to end at the first buffered write due in any of the
+		// chips; splitting the others' runs there doesn't change their output
+		uint32_t run_length = num_samples - sample_pos;
+		uint32_t i;
+
+		for (chip_idx = 0; chip_idx < num_chips; chip_idx++)
+		{
+			run_length = ESFM_write_buffer_run_length(chips[chip_idx], run_length);
+		}
+		for (chip_idx = 0; chip_idx < num_chips; chip_idx++)
+		{
+			ESFM_prepare_block(chips[chip_idx], &block_states[chip_idx]);
+		}
+
+		for (i = 0; i < run_length; i++)
+		{
+			esfm_feedback_chains chains;
+			esfm_slot *chain_slots[ESFM_FEEDBACK_LANES];
+			uint3 chain_out_shift[ESFM_FEEDBACK_LANES];
+			int num_chains = 0;
+
+			for (chip_idx = 0; chip_idx < num_chips; chip_idx++)
+			{
+				esfm_chip *chip = chips[chip_idx];
+#ifndef _ESFMU_EMU_ONLY
+				if (chip->native_mode)
+				{
+					ESFM_generate_native_front(chip, &block_states[chip_idx]);
+				}
+				else
+#endif
+				{
+					ESFM_generate_emu_front(chip, &block_states[chip_idx],
+						block_states[chip_idx].emu_rhythm_mode);
+				}
+				num_chains = ESFM_feedback_gather(&block_states[chip_idx], &chains,
+					chain_slots, chain_out_shift, num_chains);
+			}
+			{
+				// The chips share the feedback stage, which gets timed on the first one
+				ESFM_STATS_TIMER(stage_timer);
+				ESFM_feedback_run(&chains, chain_slots, chain_out_shift, num_chains,
+					block_states[0].feedback_iterations, block_states[0].feedback_avx2);
+				ESFM_STATS_LAP(chips[0], stage_timer, ESFM_STAGE_FEEDBACK);
+			}
+			for (chip_idx = 0; chip_idx < num_chips; chip_idx++)
+			{
+				esfm_chip *chip = chips[chip_idx];
+#ifndef _ESFMU_EMU_ONLY
+				if (chip->native_mode)
+				{
+					ESFM_generate_native_back(chip);
+				}
+				else
+#endif
+				{
+					ESFM_generate_emu_back(chip, &block_states[chip_idx],
+						block_states[chip_idx].emu_rhythm_mode);
+				}
+				ESFM_output_store(chip, &outputs[chip_idx], sample_pos + i);
+			}
+		}
+		sample_pos += run_length;
+
+		for (chip_idx = 0; chip_idx < num_chips; chip_idx++)
+		{
+			ESFM_write_buf_advance(chips[chip_idx], run_length - 1);
+			ESFM_update_write_buffer(chips[chip_idx]);
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ESFM_generate_stream_batch(esfm_chip *const *chips, int16_t *const *sndptrs, size_t num_chips,
+	uint32_t num_samples)
+{
+	esfm_chip *group_chips[ESFM_BATCH_GROUP_SIZE];
+	int16_t *group_sndptrs[ESFM_BATCH_GROUP_SIZE];
+	size_t group_size = 0;
+	size_t chip_idx;
+
+	for (chip_idx = 0; chip_idx < num_chips; chip_idx++)
+	{
+		// Chips in preview mode don't run in lockstep with the others, and
+		// idle ones are better off skipping ahead on their own
+		if (chips[chip_idx]->preview.enabled || ESFM_slots_idle(chips[chip_idx]))
+		{
+			ESFM_generate_stream(chips[chip_idx], sndptrs[chip_idx], num_samples);
+			continue;
+		}
+		group_chips[group_size] = chips[chip_idx];
+		group_sndptrs[group_size] = sndptrs[chip_idx];
+		if (++group_size == ESFM_BATCH_GROUP_SIZE)
+		{
+			ESFM_generate_batch_group(group_chips, group_sndptrs, group_size, num_samples);
+			group_size = 0;
+		}
+	}
+	if (group_size > 0)
+	{
+		ESFM_generate_batch_group(group_chips, group_sndptrs, group_size, num_samples);
+	}
+}
+
+/*
+ * The slot outputs feed into each other across samples, at most three levels
+ * deep (emulation mode 4-op channels: secondary slot 1, secondary slot 0,
+ * primary slot 1, primary slot 0). Generating the last few samples in full
+ * leaves them exactly as they'd be after a normal render.
+ */
+#define ESFM_SKIP_FULL_SAMPLES 3
+/* ------------------------------------------------------------------------- */
+void
+ESFM_skip(esfm_chip *chip, uint32_t num_samples)
+{
+	esfm_block_state block_state;
+	uint32_t sample_pos = 0;
+
+	while (sample_pos < num_samples)
+	{
+		uint32_t run_length = ESFM_write_buffer_run_length(chip, num_samples - sample_pos);
+		uint32_t i;
+
+		ESFM_prepare_block(chip, &block_state);
+		i = 0;
+		if (run_length > ESFM_IDLE_FULL_SAMPLES && ESFM_slots_idle(chip))
+		{
+			ESFM_advance_idle(chip, run_length - ESFM_IDLE_FULL_SAMPLES);
+			i = run_length - ESFM_IDLE_FULL_SAMPLES;
+		}
+		for (; i < run_length; i++)
+		{
+			if (num_samples - (sample_pos + i) <= ESFM_SKIP_FULL_SAMPLES)
+			{
+#ifndef _ESFMU_EMU_ONLY
+				if (chip->native_mode)
+				{
+					ESFM_generate_native(chip, &block_state);
+				}
+				else
+#endif
+				{
+					ESFM_generate_emu(chip, &block_state, block_state.emu_rhythm_mode);
+				}
+			}
+			else
+			{
+				ESFM_skip_sample(chip, &block_state, i == run_length - 1);
+			}
+		}
+		sample_pos += run_length;
+
+		ESFM_write_buf_advance(chip, run_length - 1);
+		ESFM_update_write_buffer(chip);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ESFM_set_preview(esfm_chip *chip, int feedback_iterations, int envelope_interval,
+	int decimation)
+{
+	esfm_preview *preview = &chip->preview;
 
-	for (i = 0; i < num_samples; i++)
+	if (feedback_iterations < 2 || feedback_iterations > 29)
+	{
+		feedback_iterations = feedback_iterations < 2 ? 2 : 29;
+	}
+	if (decimation < 1 || decimation > 16)
 	{
-		ESFM_generate(chip, sndptr);
-		sndptr += 2;
+		decimation = decimation < 1 ? 1 : 16;
 	}
+	preview->feedback_iterations = (uint8)feedback_iterations;
+	preview->envelope_shift = 0;
+	while (preview->envelope_shift < 4 && (2 << preview->envelope_shift) <= envelope_interval)
+	{
+		preview->envelope_shift++;
+	}
+	preview->decimation = (uint8)decimation;
+	preview->envelope_wait = 0;
+	preview->eg_counter = 0;
+	preview->enabled = feedback_iterations < 29 || preview->envelope_shift > 0 || decimation > 1;
+}
+
+#ifdef _ESFMU_ENABLE_STATS
+/* ------------------------------------------------------------------------- */
+void
+ESFM_reset_stats(esfm_chip *chip)
+{
+	memset(&chip->stats, 0, sizeof(chip->stats));
 }
+#endif
@@ -56,20 +56,123 @@ extern "C" {
 
 typedef struct _esfm_slot esfm_slot;
 typedef struct _esfm_slot_internal esfm_slot_internal;
+typedef struct _esfm_env_delay esfm_env_delay;
+typedef struct _esfm_slot_state esfm_slot_state;
 typedef struct _esfm_channel esfm_channel;
 typedef struct _esfm_chip esfm_chip;
+typedef struct _esfm_chip_with_write_buf esfm_chip_with_write_buf;
+typedef struct _esfm_write_buf esfm_write_buf;
+typedef struct _esfm_reg_event esfm_reg_event;
+typedef struct _esfm_reg_write esfm_reg_write;
+typedef struct _esfm_resampler esfm_resampler;
+typedef struct _esfm_parallel_job esfm_parallel_job;
+typedef struct _esfm_thread_pool esfm_thread_pool;
+
+typedef enum _esfm_resampler_quality
+{
+	ESFM_RESAMPLE_LINEAR,
+	ESFM_RESAMPLE_SINC_LOW,
+	ESFM_RESAMPLE_SINC_MEDIUM,
+	ESFM_RESAMPLE_SINC_HIGH
+} esfm_resampler_quality;
 
 
-void ESFM_init (esfm_chip *chip);
+// Sets up chip_with_write_buf->chip with the write queue stored next to it;
+// every other function takes that chip
+void ESFM_init (esfm_chip_with_write_buf *chip_with_write_buf);
+void ESFM_init_with_write_buf (esfm_chip *chip, esfm_write_buf *write_buf, size_t write_buf_size);
 void ESFM_write_reg (esfm_chip *chip, uint16_t address, uint8_t data);
 void ESFM_write_reg_buffered (esfm_chip *chip, uint16_t address, uint8_t data);
 void ESFM_write_reg_buffered_fast (esfm_chip *chip, uint16_t address, uint8_t data);
 void ESFM_write_port (esfm_chip *chip, uint8_t offset, uint8_t data);
+// Series of register writes, in order, to the given addresses or to
+// num_regs consecutive ones; the chip ends up in the same state as with
+// ESFM_write_reg calls, but keyscale and connection updates are done once
+void ESFM_write_regs (esfm_chip *chip, const esfm_reg_write *writes, size_t num_writes);
+void ESFM_write_reg_image (esfm_chip *chip, uint16_t address, const uint8_t *data, size_t num_regs);
 uint8_t ESFM_readback_reg (esfm_chip *chip, uint16_t address);
 uint8_t ESFM_read_port (esfm_chip *chip, uint8_t offset);
 void ESFM_generate(esfm_chip *chip, int16_t *buf);
 void ESFM_generate_stream(esfm_chip *chip, int16_t *sndptr, uint32_t num_samples);
+uint32_t ESFM_generate_stream_events(esfm_chip *chip, int16_t *sndptr, uint32_t num_samples,
+	const esfm_reg_event *events, uint32_t num_events);
+// Advances the chip by num_samples as if they were rendered, but faster
+void ESFM_skip(esfm_chip *chip, uint32_t num_samples);
+// Unclipped output; float samples are scaled by gain (1.0f / 32768 gives
+// the usual -1.0 to 1.0 range)
+void ESFM_generate_stream_int32(esfm_chip *chip, int32_t *sndptr, uint32_t num_samples);
+void ESFM_generate_stream_int32_planar(esfm_chip *chip, int32_t *left, int32_t *right,
+	uint32_t num_samples);
+void ESFM_generate_stream_float(esfm_chip *chip, float *sndptr, uint32_t num_samples, float gain);
+void ESFM_generate_stream_float_planar(esfm_chip *chip, float *left, float *right,
+	uint32_t num_samples, float gain);
+// Also renders each channel into channel_bufs[channel_idx] (18 entries, NULL
+// to skip), as stereo frames or L+R mono samples; sndptr may be NULL
+void ESFM_generate_stream_channels(esfm_chip *chip, int16_t *sndptr, int16_t *const *channel_bufs,
+	int channel_stereo, uint32_t num_samples);
+// Renders num_samples into sndptrs[n] for each of the chips; the output is
+// identical to rendering each chip on its own with ESFM_generate_stream
+void ESFM_generate_stream_batch(esfm_chip *const *chips, int16_t *const *sndptrs, size_t num_chips,
+	uint32_t num_samples);
 int16_t ESFM_get_channel_output_native(esfm_chip *chip, int channel_idx);
+// Number of samples to render until an enabled, unmasked timer overflows and
+// raises the IRQ flag (with the last of them), or ESFM_NO_IRQ if none will.
+// Doesn't account for register writes that are still queued.
+uint32_t ESFM_samples_until_irq(const esfm_chip *chip);
+#define ESFM_NO_IRQ UINT32_MAX
+// Nonzero if every envelope is fully released with its key off, no writes
+// are waiting in the write buffer and no timer is set up to raise the IRQ
+// flag, so the chip stays silent until it's written to. Rendering skips
+// ahead over idle stretches on its own either way.
+int ESFM_is_silent(const esfm_chip *chip);
+// Write queue for a producer thread feeding a chip that another thread is
+// rendering. These work like ESFM_write_reg_buffered,
+// ESFM_write_reg_buffered_fast and ESFM_write_port, but never touch the chip
+// state themselves: the rendering thread applies the writes as they come due.
+// They return 0, or -1 without queuing anything if the write queue is full or
+// has a size of 0. Only one thread may call them at a time, and no other
+// function may be called on the chip from outside the rendering thread.
+int ESFM_queue_write_reg(esfm_chip *chip, uint16_t address, uint8_t data);
+int ESFM_queue_write_reg_fast(esfm_chip *chip, uint16_t address, uint8_t data);
+int ESFM_queue_write_port(esfm_chip *chip, uint8_t offset, uint8_t data);
+// Snapshots of the whole chip state, queued writes included. ESFM_serialize
+// returns the number of bytes written, or 0 if the buffer is too small.
+// ESFM_deserialize loads into an initialized chip, keeping its write queue,
+// and returns 0 on success or -1 if the snapshot can't be loaded.
+size_t ESFM_serialized_size(const esfm_chip *chip);
+size_t ESFM_serialize(const esfm_chip *chip, uint8_t *buffer, size_t buffer_size);
+int ESFM_deserialize(esfm_chip *chip, const uint8_t *buffer, size_t buffer_size);
+// Copies the state of src into dst, an initialized chip that keeps its own
+// write queue; returns 0, or -1 if src's pending writes don't fit in it
+int ESFM_clone(esfm_chip *dst, const esfm_chip *src);
+// Approximate rendering for previews, which trades accuracy for speed and
+// is never the default. Feedback runs feedback_iterations of its 29
+// iterations (2 at the least, a single wavegen step), envelopes get updated
+// once every envelope_interval samples (rounded down to a power of two, up to
+// 16) and each output sample advances the chip by decimation samples (up to
+// 16), for an output rate of ESFM_SAMPLE_RATE / decimation. Timers and
+// buffered write delays still count chip samples. ESFM_set_preview(chip, 29,
+// 1, 1) goes back to exact rendering. Snapshots and clones don't carry these
+// settings over: each chip keeps its own.
+void ESFM_set_preview(esfm_chip *chip, int feedback_iterations, int envelope_interval,
+	int decimation);
+
+#ifdef _ESFMU_ENABLE_STATS
+// Clears the counters in chip->stats
+void ESFM_reset_stats(esfm_chip *chip);
+#endif
+
+// Optional, implemented in esfm_resampler.c
+// ESFM_resampler_init returns 0, or -1 if out_rate is 0 or too high
+int ESFM_resampler_init(esfm_resampler *resampler, uint32_t out_rate, esfm_resampler_quality quality);
+void ESFM_generate_stream_resampled(esfm_chip *chip, esfm_resampler *resampler, int16_t *sndptr,
+	uint32_t num_samples);
+
+// Optional, implemented in esfm_parallel.c
+esfm_thread_pool *ESFM_thread_pool_create(int num_threads);
+void ESFM_thread_pool_destroy(esfm_thread_pool *pool);
+void ESFM_generate_parallel(esfm_thread_pool *pool, esfm_parallel_job *jobs, size_t num_jobs,
+	uint32_t num_samples);
 
 
 // These are fake types just for syntax sugar.
@@ -80,6 +183,7 @@ typedef uint8_t uint3;
 typedef uint8_t uint4;
 typedef uint8_t uint5;
 typedef uint8_t uint6;
+typedef uint8_t uint7;
 typedef uint8_t uint8;
 typedef uint16_t uint9;
 typedef uint16_t uint10;
@@ -105,14 +209,77 @@ enum eg_states
 };
 
 
-typedef struct _esfm_write_buf
+// Accesses to the write queue fields shared by the ESFM_queue_* functions and
+// the rendering thread. Entries are handed over through their valid flag:
+// whoever sees it set owns the entry, while whoever sees it clear may fill it.
+#if defined(__GNUC__) || defined(__clang__)
+#define ESFM_QUEUE_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define ESFM_QUEUE_STORE(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+#define ESFM_QUEUE_THREAD_SAFE 1
+#else
+// No atomics to use here; the queue works, but only from a single thread
+#define ESFM_QUEUE_LOAD(ptr) (*(ptr))
+#define ESFM_QUEUE_STORE(ptr, value) (*(ptr) = (value))
+#define ESFM_QUEUE_THREAD_SAFE 0
+#endif
+
+// Set on the address of queued port writes and of port write events, which
+// keep the port offset in the low bits
+#define ESFM_QUEUE_PORT_WRITE 0x8000
+
+struct _esfm_write_buf
 {
 	uint64_t timestamp;
 	uint16_t address;
 	uint8_t data;
 	flag valid;
 
-} esfm_write_buf;
+};
+
+// Register write for ESFM_write_regs
+struct _esfm_reg_write
+{
+	uint16_t address;
+	uint8_t data;
+};
+
+// Register write for ESFM_generate_stream_events, taking effect right before
+// the output sample at sample_offset, or a port write with an address of
+// ESFM_QUEUE_PORT_WRITE | offset. Event arrays must be sorted by offset.
+struct _esfm_reg_event
+{
+	uint32_t sample_offset;
+	uint16_t address;
+	uint8_t data;
+};
+
+// One chip's share of an ESFM_generate_parallel call: renders num_samples
+// into sndptr through ESFM_generate_stream_events, which returns the number
+// of events used in events_consumed
+struct _esfm_parallel_job
+{
+	esfm_chip *chip;
+	int16_t *sndptr;
+	const esfm_reg_event *events;
+	uint32_t num_events;
+	uint32_t events_consumed;
+};
+
+/*
+ * Building with _ESFMU_EMU_ONLY leaves native mode out, for an OPL3
+ * compatible core with less state per chip. The chip never leaves emulation
+ * mode, so channels only get the two slots it uses, native mode register
+ * writes and mode switches are ignored, and the renderer has no mode to
+ * dispatch on. The emulator and everything using esfm.h need to be built
+ * with the same setting.
+ */
+#ifdef _ESFMU_EMU_ONLY
+#define ESFM_CHANNEL_SLOTS 2
+#define ESFM_NATIVE_MODE(chip) ((void)(chip), 0)
+#else
+#define ESFM_CHANNEL_SLOTS 4
+#define ESFM_NATIVE_MODE(chip) ((chip)->native_mode)
+#endif
 
 typedef struct _emu_slot_channel_mapping
 {
@@ -121,34 +288,38 @@ typedef struct _emu_slot_channel_mapping
 
 } emu_slot_channel_mapping;
 
+// Envelope delay, native mode only; _ESFMU_EMU_ONLY builds leave it out
+// of the slots
+struct _esfm_env_delay
+{
+	flag run;
+	flag transitioned_10;
+	flag transitioned_10_gate;
+	flag transitioned_01;
+	flag transitioned_01_gate;
+	uint16 counter;
+	uint16 counter_compare;
+};
+
 typedef struct _esfm_slot_internal
 {
 	uint9 eg_position;
 	uint9 eg_ksl_offset;
-	uint10 eg_output;
 
 	uint4 keyscale;
 
-	int13 output;
 	int13 emu_output_enable;
 	int13 emu_mod_enable;
 	int13 feedback_buf;
 	int13 *mod_input;
 
-	uint19 phase_acc;
-	uint10 phase_out;
-	flag phase_reset;
 	flag *key_on;
 	flag key_on_gate;
 
 	uint2 eg_state;
-	flag eg_delay_run;
-	flag eg_delay_transitioned_10;
-	flag eg_delay_transitioned_10_gate;
-	flag eg_delay_transitioned_01;
-	flag eg_delay_transitioned_01_gate;
-	uint16 eg_delay_counter;
-	uint16 eg_delay_counter_compare;
+#ifndef _ESFMU_EMU_ONLY
+	esfm_env_delay eg_delay;
+#endif
 
 } esfm_slot_internal;
 
@@ -158,6 +329,8 @@ struct _esfm_slot
 	esfm_channel *channel;
 	esfm_chip *chip;
 	uint2 slot_idx;
+	// Index into the chip's esfm_slot_state arrays
+	uint7 state_idx;
 
 	// Register data
 	int13 out_enable[2];
@@ -198,9 +371,12 @@ struct _esfm_slot
 struct _esfm_channel
 {
 	esfm_chip *chip;
-	esfm_slot slots[4];
+	esfm_slot slots[ESFM_CHANNEL_SLOTS];
 	uint5 channel_idx;
 	int16 output[2];
+	// Bit n is set when slot n's envelope generator may be doing anything
+	// other than sitting fully released; cleared slots skip envelope updates
+	uint4 slots_active;
 	flag key_on;
 	flag emu_mode_4op_enable;
 	// Only for 17th and 18th channels
@@ -208,11 +384,89 @@ struct _esfm_channel
 	flag emu_mode_4op_enable_2;
 };
 
+/*
+ * Per-slot state that's read or written on every sample, laid out as a
+ * structure of arrays so that each synthesis stage can sweep over all slots
+ * while touching as few cache lines as possible. Indexed by the slot's
+ * state_idx, which is (channel_idx * ESFM_CHANNEL_SLOTS + slot_idx).
+ */
+struct _esfm_slot_state
+{
+	uint19 phase_acc[18 * ESFM_CHANNEL_SLOTS];
+	uint10 phase_out[18 * ESFM_CHANNEL_SLOTS];
+	uint10 eg_output[18 * ESFM_CHANNEL_SLOTS];
+	int13 output[18 * ESFM_CHANNEL_SLOTS];
+	flag phase_reset[18 * ESFM_CHANNEL_SLOTS];
+
+	// Derived from register state, and recomputed before rendering only
+	// for the slots whose registers have been written since. phase_inc also
+	// depends on the vibrato position, so it's refreshed whenever that moves too.
+	uint19 phase_inc[18 * ESFM_CHANNEL_SLOTS];
+	// Total level plus KSL attenuation
+	uint10 eg_level_offset[18 * ESFM_CHANNEL_SLOTS];
+	uint8 eg_tremolo_shift[18 * ESFM_CHANNEL_SLOTS];
+	// Key scale offset to the envelope rates
+	uint4 eg_rate_keyscale[18 * ESFM_CHANNEL_SLOTS];
+};
+
 #define ESFM_WRITEBUF_SIZE 1024
 #define ESFM_WRITEBUF_DELAY 2
 
+// Settings and counters of ESFM_set_preview
+typedef struct _esfm_preview
+{
+	flag enabled;
+	uint8 feedback_iterations;
+	uint8 envelope_shift;
+	uint8 decimation;
+	// Samples left until the next envelope update
+	uint8 envelope_wait;
+	// Envelope generator clock, ticking once per update
+	uint32 eg_counter;
+
+} esfm_preview;
+
+#ifdef _ESFMU_ENABLE_STATS
+/*
+ * Rendering statistics, kept in chip->stats when built with
+ * _ESFMU_ENABLE_STATS; the emulator and everything using esfm.h need to be
+ * built with the same setting. Defining _ESFMU_ENABLE_STATS_TIMING as well
+ * also times the rendering stages, in CPU timestamp counter cycles (or in
+ * clock() ticks where there's none).
+ */
+enum esfm_stats_stages
+{
+	ESFM_STAGE_ENVELOPE,
+	ESFM_STAGE_PHASE,
+	ESFM_STAGE_SLOT_OUTPUT,
+	ESFM_STAGE_FEEDBACK,
+	ESFM_STAGE_WRITE_BUFFER,
+	ESFM_NUM_STAGES
+};
+
+typedef struct _esfm_stats
+{
+	// Samples advanced, rendered or skipped
+	uint64_t samples;
+	// Sum over those samples of the slots whose envelope was running
+	uint64_t active_slots;
+	// Feedback chains run, and the wavegen steps they took
+	uint64_t feedback_chains;
+	uint64_t feedback_iterations;
+	// Most entries ever waiting in the write queue at once
+	size_t write_buf_high_water;
+	// Buffered writes and events held back to the next sample, because they
+	// followed a note off or a bass drum register write on the same sample
+	uint64_t deferred_key_on_writes;
+	uint64_t deferred_bassdrum_writes;
+	uint64_t stage_cycles[ESFM_NUM_STAGES];
+
+} esfm_stats;
+#endif
+
 struct _esfm_chip
 {
+	esfm_slot_state slot_state;
 	esfm_channel channels[18];
 	int32 output_accm[2];
 	uint16 addr_latch;
@@ -234,6 +488,11 @@ struct _esfm_chip
 	uint8 vibrato_pos;
 	uint23 lfsr;
 
+	// One bit per slot_state index, set when that slot's derived values
+	// in slot_state need to be recomputed
+	uint32 slot_params_stale[(18 * ESFM_CHANNEL_SLOTS + 31) / 32];
+	uint8 phase_inc_vibrato_pos;
+
 	flag rm_hh_bit2;
 	flag rm_hh_bit3;
 	flag rm_hh_bit7;
@@ -248,7 +507,8 @@ struct _esfm_chip
 	flag emu_vibrato_deep;
 	flag emu_tremolo_deep;
 
-	double timer_accumulator[2];
+	// In 143rds of a timer tick
+	uint8 timer_accumulator[2];
 	uint8 timer_reload[2];
 	uint8 timer_counter[2];
 	flag timer_enable[2];
@@ -278,12 +538,55 @@ struct _esfm_chip
 	// Seems to do nothing.
 	flag test_bit_7;
 
-	esfm_write_buf write_buf[ESFM_WRITEBUF_SIZE];
+	esfm_preview preview;
+
+#ifdef _ESFMU_ENABLE_STATS
+	esfm_stats stats;
+#endif
+
+	// Register write queue, stored outside the chip. With a size of 0,
+	// buffered writes are applied immediately.
+	esfm_write_buf *write_buf;
+	size_t write_buf_size;
 	size_t write_buf_start;
 	size_t write_buf_end;
 	uint64_t write_buf_timestamp;
 };
 
+// A chip together with the ESFM_WRITEBUF_SIZE-entry write queue ESFM_init
+// gives it. Chips set up with ESFM_init_with_write_buf can be plain
+// esfm_chip structures instead, which don't carry a queue.
+struct _esfm_chip_with_write_buf
+{
+	esfm_chip chip;
+	esfm_write_buf write_buf[ESFM_WRITEBUF_SIZE];
+};
+
+// Native output sample rate, in Hz (14.31818 MHz / 288)
+#define ESFM_SAMPLE_RATE 49716
+
+#define ESFM_RESAMPLER_MAX_TAPS 32
+#define ESFM_RESAMPLER_PHASES 128
+#define ESFM_RESAMPLER_BUFFER_LEN (ESFM_RESAMPLER_MAX_TAPS + 256)
+
+// Resampling filter state for ESFM_generate_stream_resampled; keep one per
+// chip, set up with ESFM_resampler_init
+struct _esfm_resampler
+{
+	uint32_t out_rate;
+	esfm_resampler_quality quality;
+	size_t num_taps;
+
+	// Position of the filter window inside the input buffer, in frames, and
+	// fractional position of the next output sample, in 1/out_rate units
+	size_t input_pos;
+	size_t input_len;
+	uint32_t phase_frac;
+
+	float coefs[(ESFM_RESAMPLER_PHASES + 1) * ESFM_RESAMPLER_MAX_TAPS];
+	int16_t input[ESFM_RESAMPLER_BUFFER_LEN * 2];
+};
+
 #ifdef __cplusplus
 }
 #endif
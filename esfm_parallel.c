@@ -0,0 +1,289 @@
+/*
+ * ESFMu: emulator for the ESS "ESFM" enhanced OPL3 clone
+ * Copyright (C) 2023 Kagamiin~
+ *
+ * ESFMu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * ESFMu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ESFMu. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Optional thread pool for rendering many chips in parallel. Requires POSIX
+ * threads.
+ *
+ * Each chip is always rendered start to finish by a single thread, so the
+ * output doesn't depend on the number of threads or on scheduling. Jobs are
+ * handed out to the workers as contiguous ranges, which they work through
+ * front to back; a worker that runs out steals from the back of another
+ * worker's range. That way neighboring chips (and their output buffers)
+ * mostly stay on the same thread, avoiding false sharing at their edges.
+ */
+
+#include "esfm.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define ESFM_CACHE_LINE_SIZE 64
+
+typedef struct _esfm_worker_queue
+{
+	pthread_mutex_t lock;
+	size_t job_start;
+	size_t job_end;
+
+} esfm_worker_queue;
+
+// Keeps each worker's queue on cache lines of its own
+typedef union _esfm_worker_queue_padded
+{
+	esfm_worker_queue queue;
+	char padding[(sizeof(esfm_worker_queue) + ESFM_CACHE_LINE_SIZE - 1)
+		/ ESFM_CACHE_LINE_SIZE * ESFM_CACHE_LINE_SIZE];
+
+} esfm_worker_queue_padded;
+
+typedef struct _esfm_worker
+{
+	esfm_thread_pool *pool;
+	int worker_idx;
+
+} esfm_worker;
+
+struct _esfm_thread_pool
+{
+	int num_threads;
+	pthread_t *threads;
+	esfm_worker *workers;
+	esfm_worker_queue_padded *queues;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_available;
+	pthread_cond_t work_done;
+	uint64_t generation;
+	int workers_busy;
+	bool shutdown;
+
+	// Current batch of work
+	esfm_parallel_job *jobs;
+	uint32_t num_samples;
+};
+
+/* ------------------------------------------------------------------------- */
+static bool
+ESFM_worker_take_job(esfm_thread_pool *pool, int worker_idx, size_t *job_idx)
+{
+	int victim_offset;
+
+	// Own range first, from the front
+	{
+		esfm_worker_queue *queue = &pool->queues[worker_idx].queue;
+		bool found = false;
+		pthread_mutex_lock(&queue->lock);
+		if (queue->job_start < queue->job_end)
+		{
+			*job_idx = queue->job_start++;
+			found = true;
+		}
+		pthread_mutex_unlock(&queue->lock);
+		if (found)
+		{
+			return true;
+		}
+	}
+
+	// Then steal from the back of the others' ranges
+	for (victim_offset = 1; victim_offset < pool->num_threads; victim_offset++)
+	{
+		esfm_worker_queue *queue =
+			&pool->queues[(worker_idx + victim_offset) % pool->num_threads].queue;
+		bool found = false;
+		pthread_mutex_lock(&queue->lock);
+		if (queue->job_start < queue->job_end)
+		{
+			*job_idx = --queue->job_end;
+			found = true;
+		}
+		pthread_mutex_unlock(&queue->lock);
+		if (found)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_worker_run_jobs(esfm_thread_pool *pool, int worker_idx)
+{
+	size_t job_idx;
+	while (ESFM_worker_take_job(pool, worker_idx, &job_idx))
+	{
+		esfm_parallel_job *job = &pool->jobs[job_idx];
+		job->events_consumed = ESFM_generate_stream_events(job->chip, job->sndptr,
+			pool->num_samples, job->events, job->num_events);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static void *
+ESFM_worker_main(void *arg)
+{
+	esfm_worker *worker = (esfm_worker *)arg;
+	esfm_thread_pool *pool = worker->pool;
+	uint64_t generation_seen = 0;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->shutdown && pool->generation == generation_seen)
+		{
+			pthread_cond_wait(&pool->work_available, &pool->lock);
+		}
+		if (pool->shutdown)
+		{
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		generation_seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		ESFM_worker_run_jobs(pool, worker->worker_idx);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->workers_busy == 0)
+		{
+			pthread_cond_signal(&pool->work_done);
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+esfm_thread_pool *
+ESFM_thread_pool_create(int num_threads)
+{
+	esfm_thread_pool *pool;
+	int i;
+
+	if (num_threads < 1)
+	{
+		num_threads = 1;
+	}
+	pool = (esfm_thread_pool *)calloc(1, sizeof(esfm_thread_pool));
+	if (pool == NULL)
+	{
+		return NULL;
+	}
+	pool->num_threads = num_threads;
+	pool->threads = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+	pool->workers = (esfm_worker *)calloc(num_threads, sizeof(esfm_worker));
+	pool->queues = (esfm_worker_queue_padded *)calloc(num_threads, sizeof(esfm_worker_queue_padded));
+	if (pool->threads == NULL || pool->workers == NULL || pool->queues == NULL)
+	{
+		free(pool->threads);
+		free(pool->workers);
+		free(pool->queues);
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_available, NULL);
+	pthread_cond_init(&pool->work_done, NULL);
+	for (i = 0; i < num_threads; i++)
+	{
+		pthread_mutex_init(&pool->queues[i].queue.lock, NULL);
+		pool->workers[i].pool = pool;
+		pool->workers[i].worker_idx = i;
+	}
+
+	// The calling thread acts as worker 0
+	for (i = 1; i < num_threads; i++)
+	{
+		if (pthread_create(&pool->threads[i], NULL, ESFM_worker_main, &pool->workers[i]) != 0)
+		{
+			// Make do with the threads we've got
+			pool->num_threads = i;
+			break;
+		}
+	}
+	return pool;
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ESFM_thread_pool_destroy(esfm_thread_pool *pool)
+{
+	int i;
+
+	if (pool == NULL)
+	{
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->work_available);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 1; i < pool->num_threads; i++)
+	{
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	for (i = 0; i < pool->num_threads; i++)
+	{
+		pthread_mutex_destroy(&pool->queues[i].queue.lock);
+	}
+	pthread_cond_destroy(&pool->work_done);
+	pthread_cond_destroy(&pool->work_available);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool->workers);
+	free(pool->queues);
+	free(pool);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ESFM_generate_parallel(esfm_thread_pool *pool, esfm_parallel_job *jobs, size_t num_jobs,
+	uint32_t num_samples)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->jobs = jobs;
+	pool->num_samples = num_samples;
+	for (i = 0; i < pool->num_threads; i++)
+	{
+		esfm_worker_queue *queue = &pool->queues[i].queue;
+		pthread_mutex_lock(&queue->lock);
+		queue->job_start = num_jobs * i / pool->num_threads;
+		queue->job_end = num_jobs * (i + 1) / pool->num_threads;
+		pthread_mutex_unlock(&queue->lock);
+	}
+	pool->workers_busy = pool->num_threads - 1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work_available);
+	pthread_mutex_unlock(&pool->lock);
+
+	ESFM_worker_run_jobs(pool, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->workers_busy > 0)
+	{
+		pthread_cond_wait(&pool->work_done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -155,7 +155,8 @@ ESFM_emu_rearrange_connections(esfm_channel *channel)
 			| (secondary->slots[0].emu_connection_typ != 0);
 		int i;
 
-		secondary->slots[0].in.mod_input = &channel->slots[1].in.output;
+		secondary->slots[0].in.mod_input =
+			&channel->chip->slot_state.output[channel->slots[1].state_idx];
 
 		for (i = 0; i < 2; i++)
 		{
@@ -192,11 +193,45 @@ ESFM_emu_rearrange_connections(esfm_channel *channel)
 }
 
 
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_mark_all_slots_active(esfm_chip *chip)
+{
+	size_t channel_idx;
+	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	{
+		chip->channels[channel_idx].slots_active = 0x0f;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static inline void
+ESFM_mark_slot_params_stale(esfm_slot *slot)
+{
+	slot->chip->slot_params_stale[slot->state_idx >> 5] |= (uint32)1 << (slot->state_idx & 0x1f);
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_mark_all_slot_params_stale(esfm_chip *chip)
+{
+	// For the mode switches and chip-wide settings that every slot's
+	// derived values depend on
+	size_t word;
+	for (word = 0; word < sizeof(chip->slot_params_stale) / sizeof(chip->slot_params_stale[0]); word++)
+	{
+		chip->slot_params_stale[word] = ~(uint32)0;
+	}
+}
+
+#ifndef _ESFMU_EMU_ONLY
 /* ------------------------------------------------------------------------- */
 static void
 ESFM_emu_to_native_switch(esfm_chip *chip)
 {
 	size_t channel_idx, slot_idx;
+	ESFM_mark_all_slots_active(chip);
+	ESFM_mark_all_slot_params_stale(chip);
 	for (channel_idx = 0; channel_idx < 18; channel_idx++)
 	{
 		for (slot_idx = 0; slot_idx < 4; slot_idx++)
@@ -210,8 +245,7 @@ ESFM_emu_to_native_switch(esfm_chip *chip)
 			}
 			else
 			{
-				esfm_slot *prev_slot = &channel->slots[slot_idx - 1];
-				slot->in.mod_input = &prev_slot->in.output;
+				slot->in.mod_input = &chip->slot_state.output[slot->state_idx - 1];
 			}
 		}
 	}
@@ -222,17 +256,20 @@ static void
 ESFM_native_to_emu_switch(esfm_chip *chip)
 {
 	size_t channel_idx;
+	ESFM_mark_all_slots_active(chip);
+	ESFM_mark_all_slot_params_stale(chip);
 	for (channel_idx = 0; channel_idx < 18; channel_idx++)
 	{
 		ESFM_emu_rearrange_connections(&chip->channels[channel_idx]);
 	}
 }
+#endif
 
 /* ------------------------------------------------------------------------- */
 static void
 ESFM_slot_update_keyscale(esfm_slot *slot)
 {
-	if (slot->slot_idx > 0 && !slot->chip->native_mode)
+	if (slot->slot_idx > 0 && !ESFM_NATIVE_MODE(slot->chip))
 	{
 		return;
 	}
@@ -245,6 +282,7 @@ ESFM_slot_update_keyscale(esfm_slot *slot)
 	slot->in.eg_ksl_offset = ksl;
 	slot->in.keyscale = (slot->block << 1)
 		| ((slot->f_num >> (8 + !slot->chip->keyscale_mode)) & 0x01);
+	ESFM_mark_slot_params_stale(slot);
 }
 
 /* ------------------------------------------------------------------------- */
@@ -267,22 +305,143 @@ ESFM_emu_channel_update_keyscale(esfm_channel *channel)
 	ESFM_slot_update_keyscale(&channel->slots[0]);
 	channel->slots[1].in.eg_ksl_offset = channel->slots[0].in.eg_ksl_offset;
 	channel->slots[1].in.keyscale = channel->slots[0].in.keyscale;
+	ESFM_mark_slot_params_stale(&channel->slots[1]);
 
-	if (channel->emu_mode_4op_enable && (channel->channel_idx % 9) < 3 && channel->chip->emu_newmode)
+	if (channel->emu_mode_4op_enable && (channel->channel_idx % 9) < 3)
 	{
 		int i;
 		esfm_channel *secondary = &channel->chip->channels[channel->channel_idx + 3];
-		secondary->slots[0].f_num = channel->slots[0].f_num;
-		secondary->slots[0].block = channel->slots[0].block;
 
+		// The secondary channel's phase increments follow this one's frequency
 		for (i = 0; i < 2; i++)
 		{
-			secondary->slots[i].in.eg_ksl_offset = channel->slots[0].in.eg_ksl_offset;
-			secondary->slots[i].in.keyscale = channel->slots[0].in.keyscale;
+			ESFM_mark_slot_params_stale(&secondary->slots[i]);
+		}
+		if (channel->chip->emu_newmode)
+		{
+			secondary->slots[0].f_num = channel->slots[0].f_num;
+			secondary->slots[0].block = channel->slots[0].block;
+
+			for (i = 0; i < 2; i++)
+			{
+				secondary->slots[i].in.eg_ksl_offset = channel->slots[0].in.eg_ksl_offset;
+				secondary->slots[i].in.keyscale = channel->slots[0].in.keyscale;
+			}
+		}
+	}
+}
+
+/*
+ * Keyscale and connection updates requested by a series of register writes.
+ * They only depend on the registers' final contents, so they're carried out
+ * once, after the whole series; writes that change what they depend on
+ * (mode, keyscale mode, 4-op and rhythm setup) flush them first. Single
+ * writes pass a NULL batch, making the updates happen right away.
+ */
+typedef struct _esfm_reg_batch
+{
+	uint32_t slot_keyscale[3];
+	uint32_t channel_keyscale;
+	uint32_t channel_connections;
+
+} esfm_reg_batch;
+
+/* ------------------------------------------------------------------------- */
+static inline void
+ESFM_reg_batch_init(esfm_reg_batch *batch)
+{
+	batch->slot_keyscale[0] = 0;
+	batch->slot_keyscale[1] = 0;
+	batch->slot_keyscale[2] = 0;
+	batch->channel_keyscale = 0;
+	batch->channel_connections = 0;
+}
+
+/* ------------------------------------------------------------------------- */
+static inline int
+ESFM_reg_batch_take(uint32_t *bits)
+{
+	// Clears the lowest set bit, returning its index
+	int idx;
+#if defined(__GNUC__) || defined(__clang__)
+	idx = __builtin_ctz(*bits);
+#else
+	for (idx = 0; !((*bits >> idx) & 1); idx++);
+#endif
+	*bits &= *bits - 1;
+	return idx;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_reg_batch_flush(esfm_chip *chip, esfm_reg_batch *batch)
+{
+	int word;
+
+	if (batch == NULL)
+	{
+		return;
+	}
+	// Per-slot keyscale first, since in emulation mode the channel updates
+	// may copy over it for 4-op pairs
+	for (word = 0; word < 3; word++)
+	{
+		while (batch->slot_keyscale[word] != 0)
+		{
+			int state_idx = word * 32 + ESFM_reg_batch_take(&batch->slot_keyscale[word]);
+			ESFM_slot_update_keyscale(&chip->channels[state_idx / ESFM_CHANNEL_SLOTS]
+				.slots[state_idx % ESFM_CHANNEL_SLOTS]);
 		}
 	}
+	while (batch->channel_keyscale != 0)
+	{
+		ESFM_emu_channel_update_keyscale(
+			&chip->channels[ESFM_reg_batch_take(&batch->channel_keyscale)]);
+	}
+	while (batch->channel_connections != 0)
+	{
+		ESFM_emu_rearrange_connections(
+			&chip->channels[ESFM_reg_batch_take(&batch->channel_connections)]);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static inline void
+ESFM_reg_batch_slot_keyscale(esfm_reg_batch *batch, esfm_slot *slot)
+{
+	if (batch == NULL)
+	{
+		ESFM_slot_update_keyscale(slot);
+		return;
+	}
+	batch->slot_keyscale[slot->state_idx >> 5] |= (uint32_t)1 << (slot->state_idx & 0x1f);
+}
+
+/* ------------------------------------------------------------------------- */
+static inline void
+ESFM_reg_batch_channel_keyscale(esfm_reg_batch *batch, esfm_channel *channel)
+{
+	if (batch == NULL)
+	{
+		ESFM_emu_channel_update_keyscale(channel);
+		return;
+	}
+	batch->channel_keyscale |= (uint32_t)1 << channel->channel_idx;
+}
+
+/* ------------------------------------------------------------------------- */
+static inline void
+ESFM_reg_batch_channel_connections(esfm_reg_batch *batch, esfm_channel *channel)
+{
+	if (batch == NULL)
+	{
+		ESFM_emu_rearrange_connections(channel);
+		return;
+	}
+	batch->channel_connections |= (uint32_t)1 << channel->channel_idx;
 }
 
+#ifndef _ESFMU_EMU_ONLY
 /* ------------------------------------------------------------------------- */
 static inline uint8_t
 ESFM_slot_readback (esfm_slot *slot, uint8_t register_idx)
@@ -333,11 +492,13 @@ ESFM_slot_readback (esfm_slot *slot, uint8_t register_idx)
 	}
 	return data;
 }
+#endif
 
 /* ------------------------------------------------------------------------- */
 static inline void
-ESFM_slot_write (esfm_slot *slot, uint8_t register_idx, uint8_t data)
+ESFM_slot_write (esfm_slot *slot, uint8_t register_idx, uint8_t data, esfm_reg_batch *batch)
 {
+	ESFM_mark_slot_params_stale(slot);
 	switch (register_idx & 0x07)
 	{
 	case 0x00:
@@ -350,7 +511,7 @@ ESFM_slot_write (esfm_slot *slot, uint8_t register_idx, uint8_t data)
 	case 0x01:
 		slot->ksl = data >> 6;
 		slot->t_level = data & 0x3f;
-		ESFM_slot_update_keyscale(slot);
+		ESFM_reg_batch_slot_keyscale(batch, slot);
 		break;
 	case 0x02:
 		slot->attack_rate = data >> 4;
@@ -362,22 +523,25 @@ ESFM_slot_write (esfm_slot *slot, uint8_t register_idx, uint8_t data)
 		break;
 	case 0x04:
 		slot->f_num = (slot->f_num & 0x300) | data;
-		ESFM_slot_update_keyscale(slot);
+		ESFM_reg_batch_slot_keyscale(batch, slot);
 		break;
 	case 0x05:
+#ifndef _ESFMU_EMU_ONLY
 		if (slot->env_delay < (data >> 5))
 		{
-			slot->in.eg_delay_transitioned_01 = 1;
+			slot->in.eg_delay.transitioned_01 = 1;
 		}
 		else if (slot->env_delay > (data >> 5))
 		{
-			slot->in.eg_delay_transitioned_10 = 1;
+			slot->in.eg_delay.transitioned_10 = 1;
 		}
+#endif
 		slot->env_delay = data >> 5;
+		slot->channel->slots_active |= 1 << slot->slot_idx;
 		slot->emu_key_on = (data >> 5) & 0x01;
 		slot->block = (data >> 2) & 0x07;
 		slot->f_num = (slot->f_num & 0xff) | ((data & 0x03) << 8);
-		ESFM_slot_update_keyscale(slot);
+		ESFM_reg_batch_slot_keyscale(batch, slot);
 		break;
 	case 0x06:
 		slot->tremolo_deep = (data & 0x80) != 0;
@@ -405,9 +569,10 @@ ESFM_slot_write (esfm_slot *slot, uint8_t register_idx, uint8_t data)
 #define FOUROP_CONN_REG (0x504)
 #define NATIVE_MODE_REG (0x505)
 
+#ifndef _ESFMU_EMU_ONLY
 /* ------------------------------------------------------------------------- */
 static void
-ESFM_write_reg_native (esfm_chip *chip, uint16_t address, uint8_t data)
+ESFM_write_reg_native (esfm_chip *chip, uint16_t address, uint8_t data, esfm_reg_batch *batch)
 {
 	int i;
 	address = address & 0x7ff;
@@ -420,7 +585,7 @@ ESFM_write_reg_native (esfm_chip *chip, uint16_t address, uint8_t data)
 		size_t register_idx = address & 0x07;
 		esfm_slot *slot = &chip->channels[channel_idx].slots[slot_idx];
 
-		ESFM_slot_write(slot, register_idx, data);
+		ESFM_slot_write(slot, register_idx, data, batch);
 	}
 	else if (address < KEY_ON_REGS_START + 16)
 	{
@@ -429,6 +594,7 @@ ESFM_write_reg_native (esfm_chip *chip, uint16_t address, uint8_t data)
 		esfm_channel *channel = &chip->channels[channel_idx];
 		channel->key_on = data & 0x01;
 		channel->emu_mode_4op_enable = (data & 0x02) != 0;
+		channel->slots_active = 0x0f;
 	}
 	else if (address < KEY_ON_REGS_START + 20)
 	{
@@ -436,6 +602,7 @@ ESFM_write_reg_native (esfm_chip *chip, uint16_t address, uint8_t data)
 		size_t channel_idx = 16 + ((address & 0x02) >> 1);
 		bool second_half = address & 0x01;
 		esfm_channel *channel = &chip->channels[channel_idx];
+		channel->slots_active = 0x0f;
 		if (second_half)
 		{
 			channel->key_on_2 = data & 0x01;
@@ -473,12 +640,14 @@ ESFM_write_reg_native (esfm_chip *chip, uint16_t address, uint8_t data)
 			chip->timer_mask[0] = (data & 0x40) != 0;
 			break;
 		case CONFIG_REG:
+			ESFM_reg_batch_flush(chip, batch);
 			chip->keyscale_mode = (data & 0x40) != 0;
 			break;
 		case BASSDRUM_REG:
 			chip->emu_rhy_mode_flags = data & 0x3f;
 			chip->emu_vibrato_deep = (data & 0x40) != 0;
 			chip->emu_tremolo_deep = (data & 0x80) != 0;
+			ESFM_mark_all_slot_params_stale(chip);
 			break;
 		case FOUROP_CONN_REG:
 			for (i = 0; i < 3; i++)
@@ -486,6 +655,7 @@ ESFM_write_reg_native (esfm_chip *chip, uint16_t address, uint8_t data)
 				chip->channels[i].emu_mode_4op_enable = (data >> i) & 0x01;
 				chip->channels[i + 9].emu_mode_4op_enable = (data >> (i + 3)) & 0x01;
 			}
+			ESFM_mark_all_slot_params_stale(chip);
 			break;
 		case TEST_REG:
 			chip->test_bit_w0_r5_eg_halt = (data & 0x01) | ((data & 0x20) != 0);
@@ -594,10 +764,11 @@ ESFM_readback_reg_native (esfm_chip *chip, uint16_t address)
 	}
 	return data;
 }
+#endif
 
 /* ------------------------------------------------------------------------- */
 static void
-ESFM_write_reg_emu (esfm_chip *chip, uint16_t address, uint8_t data)
+ESFM_write_reg_emu (esfm_chip *chip, uint16_t address, uint8_t data, esfm_reg_batch *batch)
 {
 	bool high = (address & 0x100) != 0;
 	uint8_t reg = address & 0xff;
@@ -619,9 +790,11 @@ ESFM_write_reg_emu (esfm_chip *chip, uint16_t address, uint8_t data)
 
 	if (reg == 0xbd)
 	{
+		ESFM_reg_batch_flush(chip, batch);
 		chip->emu_rhy_mode_flags = data & 0x3f;
 		chip->emu_vibrato_deep = (data & 0x40) != 0;
 		chip->emu_tremolo_deep = (data & 0x80) != 0;
+		ESFM_mark_all_slot_params_stale(chip);
 		if (chip->emu_rhy_mode_flags & 0x20)
 		{
 			// TODO: check if writes to 0xbd actually affect the readable key-on flags at
@@ -631,6 +804,9 @@ ESFM_write_reg_emu (esfm_chip *chip, uint16_t address, uint8_t data)
 			chip->channels[8].key_on = (data & 0x04) != 0;
 			chip->channels[7].key_on_2 = (data & 0x08) != 0;
 			chip->channels[8].key_on_2 = (data & 0x02) != 0;
+			chip->channels[6].slots_active = 0x0f;
+			chip->channels[7].slots_active = 0x0f;
+			chip->channels[8].slots_active = 0x0f;
 		}
 		ESFM_emu_rearrange_connections(&chip->channels[7]);
 		ESFM_emu_rearrange_connections(&chip->channels[8]);
@@ -657,6 +833,7 @@ ESFM_write_reg_emu (esfm_chip *chip, uint16_t address, uint8_t data)
 				chip->timer_counter[1] = data;
 				break;
 			case 0x04:
+				ESFM_reg_batch_flush(chip, batch);
 				for (i = 0; i < 3; i++)
 				{
 					chip->channels[i].emu_mode_4op_enable = (data >> i) & 0x01;
@@ -667,16 +844,23 @@ ESFM_write_reg_emu (esfm_chip *chip, uint16_t address, uint8_t data)
 					ESFM_emu_rearrange_connections(&chip->channels[i]);
 					ESFM_emu_rearrange_connections(&chip->channels[i + 9]);
 				}
+				ESFM_mark_all_slot_params_stale(chip);
+				// Secondary channels in a 4-op pair take their key-on from the primary
+				ESFM_mark_all_slots_active(chip);
 				break;
 			case 0x05:
+				ESFM_reg_batch_flush(chip, batch);
 				chip->emu_newmode = data & 0x01;
+#ifndef _ESFMU_EMU_ONLY
 				if ((data & 0x80) != 0)
 				{
 					chip->native_mode = 1;
 					ESFM_emu_to_native_switch(chip);
 				}
+#endif
 				break;
 			case 0x08:
+				ESFM_reg_batch_flush(chip, batch);
 				chip->keyscale_mode = (data & 0x40) != 0;
 				break;
 			}
@@ -710,6 +894,7 @@ ESFM_write_reg_emu (esfm_chip *chip, uint16_t address, uint8_t data)
 				chip->timer_mask[0] = (data & 0x40) != 0;
 				break;
 			case 0x08:
+				ESFM_reg_batch_flush(chip, batch);
 				chip->keyscale_mode = (data & 0x40) != 0;
 				break;
 			}
@@ -718,33 +903,33 @@ ESFM_write_reg_emu (esfm_chip *chip, uint16_t address, uint8_t data)
 	case 0x20: case 0x30:
 		if (emu_slot_idx >= 0)
 		{
-			ESFM_slot_write(&chip->channels[natv_chan_idx].slots[natv_slot_idx], 0x0, data);
+			ESFM_slot_write(&chip->channels[natv_chan_idx].slots[natv_slot_idx], 0x0, data, batch);
 		}
 		break;
 	case 0x40: case 0x50:
 		if (emu_slot_idx >= 0)
 		{
-			ESFM_slot_write(&chip->channels[natv_chan_idx].slots[natv_slot_idx], 0x1, data);
-			ESFM_emu_channel_update_keyscale(&chip->channels[natv_chan_idx]);
+			ESFM_slot_write(&chip->channels[natv_chan_idx].slots[natv_slot_idx], 0x1, data, batch);
+			ESFM_reg_batch_channel_keyscale(batch, &chip->channels[natv_chan_idx]);
 		}
 		break;
 	case 0x60: case 0x70:
 		if (emu_slot_idx >= 0)
 		{
-			ESFM_slot_write(&chip->channels[natv_chan_idx].slots[natv_slot_idx], 0x2, data);
+			ESFM_slot_write(&chip->channels[natv_chan_idx].slots[natv_slot_idx], 0x2, data, batch);
 		}
 		break;
 	case 0x80: case 0x90:
 		if (emu_slot_idx >= 0)
 		{
-			ESFM_slot_write(&chip->channels[natv_chan_idx].slots[natv_slot_idx], 0x3, data);
+			ESFM_slot_write(&chip->channels[natv_chan_idx].slots[natv_slot_idx], 0x3, data, batch);
 		}
 		break;
 	case 0xa0:
 		if (emu_chan_idx >= 0)
 		{
-			ESFM_slot_write(&chip->channels[emu_chan_idx].slots[0], 0x4, data);
-			ESFM_emu_channel_update_keyscale(&chip->channels[emu_chan_idx]);
+			ESFM_slot_write(&chip->channels[emu_chan_idx].slots[0], 0x4, data, batch);
+			ESFM_reg_batch_channel_keyscale(batch, &chip->channels[emu_chan_idx]);
 		}
 		break;
 	case 0xb0:
@@ -758,21 +943,26 @@ ESFM_write_reg_emu (esfm_chip *chip, uint16_t address, uint8_t data)
 			{
 				channel->key_on_2 = (data & 0x20) != 0;
 			}
-			ESFM_slot_write(&channel->slots[0], 0x5, data);
-			ESFM_emu_channel_update_keyscale(&chip->channels[emu_chan_idx]);
+			channel->slots_active = 0x0f;
+			if ((channel->channel_idx % 9) < 3)
+			{
+				chip->channels[channel->channel_idx + 3].slots_active = 0x0f;
+			}
+			ESFM_slot_write(&channel->slots[0], 0x5, data, batch);
+			ESFM_reg_batch_channel_keyscale(batch, &chip->channels[emu_chan_idx]);
 		}
 		break;
 	case 0xc0:
 		if (emu_chan_idx >= 0)
 		{
-			ESFM_slot_write(&chip->channels[emu_chan_idx].slots[0], 0x6, data);
-			ESFM_emu_rearrange_connections(&chip->channels[emu_chan_idx]);
+			ESFM_slot_write(&chip->channels[emu_chan_idx].slots[0], 0x6, data, batch);
+			ESFM_reg_batch_channel_connections(batch, &chip->channels[emu_chan_idx]);
 		}
 		break;
 	case 0xe0: case 0xf0:
 		if (emu_slot_idx >= 0)
 		{
-			ESFM_slot_write(&chip->channels[natv_chan_idx].slots[natv_slot_idx], 0x7, data);
+			ESFM_slot_write(&chip->channels[natv_chan_idx].slots[natv_slot_idx], 0x7, data, batch);
 		}
 		break;
 	}
@@ -780,87 +970,198 @@ ESFM_write_reg_emu (esfm_chip *chip, uint16_t address, uint8_t data)
 
 
 /* ------------------------------------------------------------------------- */
-void
-ESFM_write_reg (esfm_chip *chip, uint16_t address, uint8_t data)
+static inline void
+ESFM_write_reg_batched (esfm_chip *chip, uint16_t address, uint8_t data, esfm_reg_batch *batch)
 {
+#ifndef _ESFMU_EMU_ONLY
 	if (chip->native_mode)
 	{
-		ESFM_write_reg_native(chip, address, data);
-		return;
+		ESFM_write_reg_native(chip, address, data, batch);
 	}
 	else
+#endif
 	{
-		ESFM_write_reg_emu(chip, address, data);
-		return;
+		ESFM_write_reg_emu(chip, address, data, batch);
 	}
 }
 
 /* ------------------------------------------------------------------------- */
 void
-ESFM_write_reg_buffered (esfm_chip *chip, uint16_t address, uint8_t data)
+ESFM_write_reg (esfm_chip *chip, uint16_t address, uint8_t data)
 {
-	uint64_t timestamp;
-	esfm_write_buf *new_entry, *last_entry;
+	ESFM_write_reg_batched(chip, address, data, NULL);
+}
 
-	new_entry = &chip->write_buf[chip->write_buf_end];
-	last_entry = &chip->write_buf[(chip->write_buf_end - 1) % ESFM_WRITEBUF_SIZE];
+/* ------------------------------------------------------------------------- */
+void
+ESFM_write_regs (esfm_chip *chip, const esfm_reg_write *writes, size_t num_writes)
+{
+	esfm_reg_batch batch;
+	size_t i;
 
-	if (new_entry->valid) {
-		ESFM_write_reg(chip, new_entry->address, new_entry->data);
-		chip->write_buf_start = (chip->write_buf_end + 1) % ESFM_WRITEBUF_SIZE;
+	ESFM_reg_batch_init(&batch);
+	for (i = 0; i < num_writes; i++)
+	{
+		ESFM_write_reg_batched(chip, writes[i].address, writes[i].data, &batch);
+	}
+	ESFM_reg_batch_flush(chip, &batch);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ESFM_write_reg_image (esfm_chip *chip, uint16_t address, const uint8_t *data, size_t num_regs)
+{
+	esfm_reg_batch batch;
+	size_t i;
+
+	ESFM_reg_batch_init(&batch);
+	for (i = 0; i < num_regs; i++)
+	{
+		ESFM_write_reg_batched(chip, (uint16_t)(address + i), data[i], &batch);
+	}
+	ESFM_reg_batch_flush(chip, &batch);
+}
+
+/* ------------------------------------------------------------------------- */
+static int
+ESFM_write_buf_push(esfm_chip *chip, uint16_t address, uint8_t data, bool delayed)
+{
+	// Fills in the entry at the end of the write queue, handing it over to the
+	// rendering thread last; returns -1 if the queue is full
+	esfm_write_buf *new_entry = &chip->write_buf[chip->write_buf_end];
+	uint64_t timestamp = ESFM_QUEUE_LOAD(&chip->write_buf_timestamp);
+
+	if (ESFM_QUEUE_LOAD(&new_entry->valid))
+	{
+		return -1;
+	}
+
+	if (delayed)
+	{
+		const esfm_write_buf *last_entry =
+			&chip->write_buf[(chip->write_buf_end + chip->write_buf_size - 1) % chip->write_buf_size];
+		if (last_entry->timestamp + ESFM_WRITEBUF_DELAY > timestamp)
+		{
+			timestamp = last_entry->timestamp + ESFM_WRITEBUF_DELAY;
+		}
 	}
 
-	new_entry->valid = 1;
 	new_entry->address = address;
 	new_entry->data = data;
-	timestamp = last_entry->timestamp + ESFM_WRITEBUF_DELAY;
-	if (timestamp < chip->write_buf_timestamp)
+	new_entry->timestamp = timestamp;
+	ESFM_QUEUE_STORE(&new_entry->valid, 1);
+	// Published for the rendering thread's queue statistics
+	ESFM_QUEUE_STORE(&chip->write_buf_end, (chip->write_buf_end + 1) % chip->write_buf_size);
+	return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_write_buf_make_room(esfm_chip *chip)
+{
+	// Applies the oldest write right away if the queue is full
+	esfm_write_buf *new_entry = &chip->write_buf[chip->write_buf_end];
+
+	if (new_entry->valid) {
+		// The same as the rendering thread does with it, without waiting
+		// out key-on conflicts
+		if (new_entry->address & ESFM_QUEUE_PORT_WRITE)
+		{
+			ESFM_write_port(chip, new_entry->address & 0x03, new_entry->data);
+		}
+		else
+		{
+			ESFM_write_reg(chip, new_entry->address, new_entry->data);
+		}
+		new_entry->valid = 0;
+		chip->write_buf_start = (chip->write_buf_end + 1) % chip->write_buf_size;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ESFM_write_reg_buffered (esfm_chip *chip, uint16_t address, uint8_t data)
+{
+	if (chip->write_buf_size == 0)
 	{
-		timestamp = chip->write_buf_timestamp;
+		ESFM_write_reg(chip, address, data);
+		return;
 	}
 
-	new_entry->timestamp = timestamp;
-	chip->write_buf_end = (chip->write_buf_end + 1) % ESFM_WRITEBUF_SIZE;
+	ESFM_write_buf_make_room(chip);
+	ESFM_write_buf_push(chip, address & 0x7ff, data, true);
 }
 
 /* ------------------------------------------------------------------------- */
 void
 ESFM_write_reg_buffered_fast (esfm_chip *chip, uint16_t address, uint8_t data)
 {
-	esfm_write_buf *new_entry;
+	if (chip->write_buf_size == 0)
+	{
+		ESFM_write_reg(chip, address, data);
+		return;
+	}
 
-	new_entry = &chip->write_buf[chip->write_buf_end];
+	ESFM_write_buf_make_room(chip);
+	ESFM_write_buf_push(chip, address & 0x7ff, data, false);
+}
 
-	if (new_entry->valid) {
-		ESFM_write_reg(chip, new_entry->address, new_entry->data);
-		chip->write_buf_start = (chip->write_buf_end + 1) % ESFM_WRITEBUF_SIZE;
+/* ------------------------------------------------------------------------- */
+int
+ESFM_queue_write_reg(esfm_chip *chip, uint16_t address, uint8_t data)
+{
+	if (chip->write_buf_size == 0)
+	{
+		return -1;
 	}
+	return ESFM_write_buf_push(chip, address & 0x7ff, data, true);
+}
 
-	new_entry->valid = 1;
-	new_entry->address = address;
-	new_entry->data = data;
-	new_entry->timestamp = chip->write_buf_timestamp;
-	chip->write_buf_end = (chip->write_buf_end + 1) % ESFM_WRITEBUF_SIZE;
+/* ------------------------------------------------------------------------- */
+int
+ESFM_queue_write_reg_fast(esfm_chip *chip, uint16_t address, uint8_t data)
+{
+	if (chip->write_buf_size == 0)
+	{
+		return -1;
+	}
+	return ESFM_write_buf_push(chip, address & 0x7ff, data, false);
+}
+
+/* ------------------------------------------------------------------------- */
+int
+ESFM_queue_write_port(esfm_chip *chip, uint8_t offset, uint8_t data)
+{
+	// Port writes take effect as soon as the rendering thread gets to them,
+	// like ESFM_write_port does
+	if (chip->write_buf_size == 0)
+	{
+		return -1;
+	}
+	return ESFM_write_buf_push(chip, ESFM_QUEUE_PORT_WRITE | (offset & 0x03), data, false);
 }
 
 /* ------------------------------------------------------------------------- */
 uint8_t
 ESFM_readback_reg (esfm_chip *chip, uint16_t address)
 {
+#ifndef _ESFMU_EMU_ONLY
 	if (chip->native_mode)
 	{
 		return ESFM_readback_reg_native(chip, address);
 	}
-	else
-	{
-		return 0;
-	}
+#else
+	(void)chip;
+	(void)address;
+#endif
+	return 0;
 }
 
 /* ------------------------------------------------------------------------- */
 void
 ESFM_write_port (esfm_chip *chip, uint8_t offset, uint8_t data)
 {
+#ifndef _ESFMU_EMU_ONLY
 	if (chip->native_mode)
 	{
 		switch(offset)
@@ -872,7 +1173,7 @@ ESFM_write_port (esfm_chip *chip, uint8_t offset, uint8_t data)
 			chip->addr_latch = data;
 			break;
 		case 1:
-			ESFM_write_reg_native(chip, chip->addr_latch, data);
+			ESFM_write_reg(chip, chip->addr_latch, data);
 			break;
 		case 2:
 			chip->addr_latch = (chip->addr_latch & 0xff00) | data;
@@ -884,6 +1185,7 @@ ESFM_write_port (esfm_chip *chip, uint8_t offset, uint8_t data)
 		}
 	}
 	else
+#endif
 	{
 		switch(offset)
 		{
@@ -891,7 +1193,7 @@ ESFM_write_port (esfm_chip *chip, uint8_t offset, uint8_t data)
 			chip->addr_latch = data;
 			break;
 		case 1: case 3:
-			ESFM_write_reg_emu(chip, chip->addr_latch, data);
+			ESFM_write_reg(chip, chip->addr_latch, data);
 			break;
 		case 2:
 			chip->addr_latch = (uint16)data | 0x100;
@@ -914,14 +1216,12 @@ ESFM_read_port (esfm_chip *chip, uint8_t offset)
 		data |= (chip->timer_overflow[1] != 0) << 5;
 		break;
 	case 1:
+#ifndef _ESFMU_EMU_ONLY
 		if (chip->native_mode)
 		{
 			data = ESFM_readback_reg_native(chip, chip->addr_latch);
 		}
-		else
-		{
-			data = 0;
-		}
+#endif
 		break;
 	case 2: case 3:
 		// This matches OPL3 behavior.
@@ -936,6 +1236,11 @@ ESFM_read_port (esfm_chip *chip, uint8_t offset)
 void
 ESFM_set_mode (esfm_chip *chip, bool native_mode)
 {
+#ifdef _ESFMU_EMU_ONLY
+	// There's no native mode to switch to
+	(void)chip;
+	(void)native_mode;
+#else
 	native_mode = native_mode != 0;
 
 	if (native_mode != (chip->native_mode != 0))
@@ -950,20 +1255,49 @@ ESFM_set_mode (esfm_chip *chip, bool native_mode)
 			ESFM_native_to_emu_switch(chip);
 		}
 	}
+#endif
 }
 
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_slot_set_defaults(esfm_slot *slot, int slot_idx, uint10 *eg_output)
+{
+	// The values ESFM_init gives a slot, other than zeros and pointers
+	slot->in.eg_position = 0x1ff;
+	*eg_output = 0x1ff;
+	slot->in.eg_state = EG_RELEASE;
+	slot->in.emu_mod_enable = ~((int13) 0);
+	if (slot_idx == 1)
+	{
+		slot->in.emu_output_enable = ~((int13) 0);
+	}
+	slot->out_enable[0] = slot->out_enable[1] = ~((int13) 0);
+}
+
+/*
+ * Initializes a chip that queues buffered register writes in the given
+ * caller-owned array of write_buf_size entries, which has to outlive the
+ * chip. Passing a NULL array with a size of 0 makes buffered writes take
+ * effect immediately.
+ */
 /* ------------------------------------------------------------------------- */
 void
-ESFM_init (esfm_chip *chip)
+ESFM_init_with_write_buf (esfm_chip *chip, esfm_write_buf *write_buf, size_t write_buf_size)
 {
 	esfm_slot *slot;
 	esfm_channel *channel;
 	size_t channel_idx, slot_idx;
 
 	memset(chip, 0, sizeof(esfm_chip));
+	if (write_buf_size > 0)
+	{
+		memset(write_buf, 0, write_buf_size * sizeof(esfm_write_buf));
+	}
+	chip->write_buf = write_buf;
+	chip->write_buf_size = write_buf_size;
 	for (channel_idx = 0; channel_idx < 18; channel_idx++)
 	{
-		for (slot_idx = 0; slot_idx < 4; slot_idx++)
+		for (slot_idx = 0; slot_idx < ESFM_CHANNEL_SLOTS; slot_idx++)
 		{
 			channel = &chip->channels[channel_idx];
 			slot = &channel->slots[slot_idx];
@@ -973,22 +1307,15 @@ ESFM_init (esfm_chip *chip)
 			slot->channel = channel;
 			slot->chip = chip;
 			slot->slot_idx = slot_idx;
-			slot->in.eg_position = slot->in.eg_output = 0x1ff;
-			slot->in.eg_state = EG_RELEASE;
-			slot->in.emu_mod_enable = ~((int13) 0);
+			slot->state_idx = channel_idx * ESFM_CHANNEL_SLOTS + slot_idx;
+			ESFM_slot_set_defaults(slot, (int)slot_idx, &chip->slot_state.eg_output[slot->state_idx]);
 			if (slot_idx == 0)
 			{
 				slot->in.mod_input = &slot->in.feedback_buf;
 			}
 			else
 			{
-				esfm_slot *prev_slot = &channel->slots[slot_idx - 1];
-				slot->in.mod_input = &prev_slot->in.output;
-			}
-
-			if (slot_idx == 1)
-			{
-				slot->in.emu_output_enable = ~((int13) 0);
+				slot->in.mod_input = &chip->slot_state.output[slot->state_idx - 1];
 			}
 
 			if (channel_idx > 15 && slot_idx & 0x02)
@@ -999,11 +1326,696 @@ ESFM_init (esfm_chip *chip)
 			{
 				slot->in.key_on = &channel->key_on;
 			}
-
-			slot->out_enable[0] = slot->out_enable[1] = ~((int13) 0);
 		}
 	}
 
 	chip->lfsr = 1;
+	ESFM_mark_all_slot_params_stale(chip);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ESFM_init (esfm_chip_with_write_buf *chip_with_write_buf)
+{
+	ESFM_init_with_write_buf(&chip_with_write_buf->chip, chip_with_write_buf->write_buf,
+		ESFM_WRITEBUF_SIZE);
+}
+
+
+/*
+ * Chip state snapshots.
+ *
+ * The format is a small header followed by every field that makes up the
+ * chip's internal state, in a fixed order and in little-endian byte order,
+ * followed by the pending buffered writes. Pointers are not stored: they're
+ * rebuilt the same way ESFM_init sets them up, except for each slot's
+ * modulator input, whose wiring depends on the mode switching history in
+ * emulation mode and is stored as the index of the slot it reads from.
+ *
+ * A single function walks the fields for saving, loading and measuring, so
+ * the three can never disagree on the layout. Bump ESFM_STATE_VERSION
+ * whenever that layout changes. Loading walks the fields twice, first
+ * only to check each one against the range it can hold, so that a corrupt
+ * snapshot gets rejected before anything in the chip is touched.
+ *
+ * _ESFMU_EMU_ONLY builds use the same format. They store slots 2 and 3 the
+ * way emulation mode leaves them, and skip them when loading. They have no
+ * envelope delay state, which regular builds keep running in emulation
+ * mode too: each slot's delay run flag, transition flags, counter and
+ * compare value get stored as zeros, and dropped when loading. For the
+ * same history, snapshots from the two builds only differ in those fields.
+ * Snapshots taken in native mode can't be loaded into these builds.
+ */
+
+#define ESFM_STATE_VERSION 2
+#define ESFM_STATE_HEADER_SIZE 10
+#define ESFM_STATE_WRITE_BUF_ENTRY_SIZE 11
+
+// Loaded fields are checked against the width of the register or counter
+// they hold; these few can't reach their type's full range. The envelope
+// output is the position plus the level offset and tremolo, and the timer
+// accumulator stays within ESFM_TIMER_PERIOD.
+#define ESFM_STATE_MAX_EG_OUTPUT 0x7ff
+#define ESFM_STATE_MAX_TIMER_ACCUMULATOR 143
+#ifdef _ESFMU_EMU_ONLY
+#define ESFM_STATE_MAX_NATIVE_MODE 0
+#else
+#define ESFM_STATE_MAX_NATIVE_MODE 1
+#endif
+
+typedef struct _esfm_state_stream
+{
+	// NULL when only measuring
+	uint8_t *data;
+	size_t pos;
+	bool reading;
+	// Reading only to check the values, without storing them
+	bool checking;
+	// Cleared when a value read is out of range
+	bool valid;
+
+} esfm_state_stream;
+
+/* ------------------------------------------------------------------------- */
+static uint64_t
+ESFM_state_value(esfm_state_stream *stream, uint64_t value, int num_bytes)
+{
+	int i;
+
+	if (stream->reading)
+	{
+		value = 0;
+		for (i = 0; i < num_bytes; i++)
+		{
+			value |= (uint64_t)stream->data[stream->pos + i] << (i * 8);
+		}
+	}
+	else if (stream->data != NULL)
+	{
+		for (i = 0; i < num_bytes; i++)
+		{
+			stream->data[stream->pos + i] = (uint8_t)(value >> (i * 8));
+		}
+	}
+	stream->pos += num_bytes;
+	return value;
+}
+
+/* ------------------------------------------------------------------------- */
+static bool
+ESFM_state_load(esfm_state_stream *stream, bool in_range)
+{
+	// Whether a value that was just read should be stored
+	if (!stream->reading)
+	{
+		return false;
+	}
+	if (!in_range)
+	{
+		stream->valid = false;
+	}
+	return !stream->checking;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_state_u8(esfm_state_stream *stream, uint8_t *value, uint8_t max)
+{
+	uint8_t result = (uint8_t)ESFM_state_value(stream, *value, 1);
+	if (ESFM_state_load(stream, result <= max))
+	{
+		*value = result;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_state_u16(esfm_state_stream *stream, uint16_t *value, uint16_t max)
+{
+	uint16_t result = (uint16_t)ESFM_state_value(stream, *value, 2);
+	if (ESFM_state_load(stream, result <= max))
+	{
+		*value = result;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_state_s16(esfm_state_stream *stream, int16_t *value, int16_t max)
+{
+	// Allowed from -max - 1 to max
+	int16_t result = (int16_t)ESFM_state_value(stream, (uint16_t)*value, 2);
+	if (ESFM_state_load(stream, result <= max && result >= -max - 1))
+	{
+		*value = result;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_state_u32(esfm_state_stream *stream, uint32_t *value, uint32_t max)
+{
+	uint32_t result = (uint32_t)ESFM_state_value(stream, *value, 4);
+	if (ESFM_state_load(stream, result <= max))
+	{
+		*value = result;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_state_s32(esfm_state_stream *stream, int32_t *value)
+{
+	int32_t result = (int32_t)(uint32_t)ESFM_state_value(stream, (uint32_t)*value, 4);
+	if (ESFM_state_load(stream, true))
+	{
+		*value = result;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_state_u64(esfm_state_stream *stream, uint64_t *value, uint64_t max)
+{
+	uint64_t result = ESFM_state_value(stream, *value, 8);
+	if (ESFM_state_load(stream, result <= max))
+	{
+		*value = result;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static uint8_t
+ESFM_slot_get_mod_source(const esfm_slot *slot)
+{
+	// 0 for the slot's own feedback buffer, otherwise 1 + the state index of
+	// the slot whose output it's modulated by, as laid out with all 4 slots
+	// per channel
+	int state_idx;
+	if (slot->in.mod_input == &slot->in.feedback_buf)
+	{
+		return 0;
+	}
+	state_idx = (int)(slot->in.mod_input - slot->chip->slot_state.output);
+	return (uint8_t)((state_idx / ESFM_CHANNEL_SLOTS) * 4 + state_idx % ESFM_CHANNEL_SLOTS + 1);
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_slot_set_mod_source(esfm_slot *slot, uint8_t mod_source)
+{
+	int channel_idx = (mod_source - 1) / 4;
+	int slot_idx = (mod_source - 1) % 4;
+	if (mod_source == 0)
+	{
+		slot->in.mod_input = &slot->in.feedback_buf;
+	}
+	else
+	{
+		slot->in.mod_input =
+			&slot->chip->slot_state.output[channel_idx * ESFM_CHANNEL_SLOTS + slot_idx];
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_state_env_delay(esfm_state_stream *stream, esfm_env_delay *delay)
+{
+	ESFM_state_u8(stream, &delay->run, 1);
+	ESFM_state_u8(stream, &delay->transitioned_10, 1);
+	ESFM_state_u8(stream, &delay->transitioned_10_gate, 1);
+	ESFM_state_u8(stream, &delay->transitioned_01, 1);
+	ESFM_state_u8(stream, &delay->transitioned_01_gate, 1);
+	ESFM_state_u16(stream, &delay->counter, 0xffff);
+	ESFM_state_u16(stream, &delay->counter_compare, 0xffff);
+}
+
+/*
+ * A slot's values that live outside its esfm_slot structure: its entries in
+ * the chip's slot_state arrays, and its modulator input.
+ */
+typedef struct _esfm_state_slot_extra
+{
+	uint19 phase_acc;
+	uint10 phase_out;
+	uint10 eg_output;
+	int13 output;
+	flag phase_reset;
+	uint8 mod_source;
+
+} esfm_state_slot_extra;
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_state_slot_fields(esfm_state_stream *stream, esfm_slot *slot, esfm_env_delay *delay,
+	esfm_state_slot_extra *extra, int num_sources)
+{
+	// The modulator source can name any of the first num_sources slots of
+	// a channel
+	uint8_t mod_source;
+
+	ESFM_state_s16(stream, &slot->out_enable[0], 0xfff);
+	ESFM_state_s16(stream, &slot->out_enable[1], 0xfff);
+	ESFM_state_u16(stream, &slot->f_num, 0x3ff);
+	ESFM_state_u8(stream, &slot->block, 7);
+	ESFM_state_u8(stream, &slot->output_level, 7);
+	ESFM_state_u8(stream, &slot->mod_in_level, 7);
+	ESFM_state_u8(stream, &slot->t_level, 0x3f);
+	ESFM_state_u8(stream, &slot->mult, 0x0f);
+	ESFM_state_u8(stream, &slot->waveform, 7);
+	ESFM_state_u8(stream, &slot->rhy_noise, 3);
+	ESFM_state_u8(stream, &slot->attack_rate, 0x0f);
+	ESFM_state_u8(stream, &slot->decay_rate, 0x0f);
+	ESFM_state_u8(stream, &slot->sustain_lvl, 0x0f);
+	ESFM_state_u8(stream, &slot->release_rate, 0x0f);
+	ESFM_state_u8(stream, &slot->tremolo_en, 1);
+	ESFM_state_u8(stream, &slot->tremolo_deep, 1);
+	ESFM_state_u8(stream, &slot->vibrato_en, 1);
+	ESFM_state_u8(stream, &slot->vibrato_deep, 1);
+	ESFM_state_u8(stream, &slot->emu_connection_typ, 1);
+	ESFM_state_u8(stream, &slot->env_sustaining, 1);
+	ESFM_state_u8(stream, &slot->ksr, 1);
+	ESFM_state_u8(stream, &slot->ksl, 3);
+	ESFM_state_u8(stream, &slot->env_delay, 7);
+	ESFM_state_u8(stream, &slot->emu_key_on, 1);
+
+	ESFM_state_u16(stream, &slot->in.eg_position, 0x1ff);
+	ESFM_state_u16(stream, &slot->in.eg_ksl_offset, 0x1ff);
+	ESFM_state_u8(stream, &slot->in.keyscale, 0x0f);
+	ESFM_state_s16(stream, &slot->in.emu_output_enable, 0xfff);
+	ESFM_state_s16(stream, &slot->in.emu_mod_enable, 0xfff);
+	ESFM_state_s16(stream, &slot->in.feedback_buf, 0xfff);
+	ESFM_state_u8(stream, &slot->in.key_on_gate, 1);
+	ESFM_state_u8(stream, &slot->in.eg_state, EG_RELEASE);
+	ESFM_state_env_delay(stream, delay);
+
+	ESFM_state_u32(stream, &extra->phase_acc, 0x7ffff);
+	ESFM_state_u16(stream, &extra->phase_out, 0x3ff);
+	ESFM_state_u16(stream, &extra->eg_output, ESFM_STATE_MAX_EG_OUTPUT);
+	ESFM_state_s16(stream, &extra->output, 0xfff);
+	ESFM_state_u8(stream, &extra->phase_reset, 1);
+
+	mod_source = (uint8_t)ESFM_state_value(stream, extra->mod_source, 1);
+	if (ESFM_state_load(stream, mod_source == 0
+		|| (mod_source <= 18 * 4 && (mod_source - 1) % 4 < num_sources)))
+	{
+		extra->mod_source = mod_source;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_state_slot(esfm_state_stream *stream, esfm_slot *slot)
+{
+	esfm_slot_state *state = &slot->chip->slot_state;
+	int state_idx = slot->state_idx;
+	esfm_state_slot_extra extra;
+#ifndef _ESFMU_EMU_ONLY
+	esfm_env_delay *delay = &slot->in.eg_delay;
+#else
+	// Stored as idle, and dropped when loading
+	esfm_env_delay idle_delay;
+	esfm_env_delay *delay = &idle_delay;
+	memset(&idle_delay, 0, sizeof(esfm_env_delay));
+#endif
+
+	extra.phase_acc = state->phase_acc[state_idx];
+	extra.phase_out = state->phase_out[state_idx];
+	extra.eg_output = state->eg_output[state_idx];
+	extra.output = state->output[state_idx];
+	extra.phase_reset = state->phase_reset[state_idx];
+	extra.mod_source = ESFM_slot_get_mod_source(slot);
+
+	ESFM_state_slot_fields(stream, slot, delay, &extra, ESFM_CHANNEL_SLOTS);
+
+	if (stream->reading && !stream->checking)
+	{
+		state->phase_acc[state_idx] = extra.phase_acc;
+		state->phase_out[state_idx] = extra.phase_out;
+		state->eg_output[state_idx] = extra.eg_output;
+		state->output[state_idx] = extra.output;
+		state->phase_reset[state_idx] = extra.phase_reset;
+		ESFM_slot_set_mod_source(slot, extra.mod_source);
+	}
 }
 
+#ifdef _ESFMU_EMU_ONLY
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_state_idle_slot(esfm_state_stream *stream, int channel_idx, int slot_idx)
+{
+	// Native mode slots 2 and 3, which stay the way ESFM_init sets them up
+	// in emulation mode; read back and dropped when loading
+	esfm_slot slot;
+	esfm_env_delay delay;
+	esfm_state_slot_extra extra;
+
+	memset(&slot, 0, sizeof(esfm_slot));
+	memset(&delay, 0, sizeof(esfm_env_delay));
+	memset(&extra, 0, sizeof(esfm_state_slot_extra));
+	ESFM_slot_set_defaults(&slot, slot_idx, &extra.eg_output);
+	// Modulated by the previous slot
+	extra.mod_source = (uint8)(channel_idx * 4 + slot_idx);
+	ESFM_state_slot_fields(stream, &slot, &delay, &extra, 4);
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_state_chip(esfm_state_stream *stream, esfm_chip *chip)
+{
+	size_t channel_idx, slot_idx;
+	int i;
+
+	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	{
+		esfm_channel *channel = &chip->channels[channel_idx];
+		for (slot_idx = 0; slot_idx < 4; slot_idx++)
+		{
+#ifdef _ESFMU_EMU_ONLY
+			if (slot_idx >= ESFM_CHANNEL_SLOTS)
+			{
+				ESFM_state_idle_slot(stream, (int)channel_idx, (int)slot_idx);
+				continue;
+			}
+#endif
+			ESFM_state_slot(stream, &channel->slots[slot_idx]);
+		}
+		ESFM_state_s16(stream, &channel->output[0], 0x7fff);
+		ESFM_state_s16(stream, &channel->output[1], 0x7fff);
+		ESFM_state_u8(stream, &channel->slots_active, 0x0f);
+		ESFM_state_u8(stream, &channel->key_on, 1);
+		ESFM_state_u8(stream, &channel->emu_mode_4op_enable, 1);
+		ESFM_state_u8(stream, &channel->key_on_2, 1);
+		ESFM_state_u8(stream, &channel->emu_mode_4op_enable_2, 1);
+	}
+
+	ESFM_state_s32(stream, &chip->output_accm[0]);
+	ESFM_state_s32(stream, &chip->output_accm[1]);
+	ESFM_state_u16(stream, &chip->addr_latch, 0xffff);
+	ESFM_state_u8(stream, &chip->emu_wavesel_enable, 1);
+	ESFM_state_u8(stream, &chip->emu_newmode, 1);
+	ESFM_state_u8(stream, &chip->native_mode, ESFM_STATE_MAX_NATIVE_MODE);
+	ESFM_state_u8(stream, &chip->keyscale_mode, 1);
+
+	ESFM_state_u64(stream, &chip->eg_timer, (1llu << 36) - 1);
+	ESFM_state_u16(stream, &chip->global_timer, 0x3ff);
+	ESFM_state_u8(stream, &chip->eg_clocks, 13);
+	ESFM_state_u8(stream, &chip->eg_tick, 1);
+	ESFM_state_u8(stream, &chip->eg_timer_overflow, 1);
+	ESFM_state_u8(stream, &chip->tremolo, 105);
+	ESFM_state_u8(stream, &chip->tremolo_pos, 209);
+	ESFM_state_u8(stream, &chip->vibrato_pos, 7);
+	ESFM_state_u32(stream, &chip->lfsr, 0x7fffff);
+
+	ESFM_state_u8(stream, &chip->rm_hh_bit2, 1);
+	ESFM_state_u8(stream, &chip->rm_hh_bit3, 1);
+	ESFM_state_u8(stream, &chip->rm_hh_bit7, 1);
+	ESFM_state_u8(stream, &chip->rm_hh_bit8, 1);
+	ESFM_state_u8(stream, &chip->rm_tc_bit3, 1);
+	ESFM_state_u8(stream, &chip->rm_tc_bit5, 1);
+	ESFM_state_u8(stream, &chip->emu_rhy_mode_flags, 0xff);
+	ESFM_state_u8(stream, &chip->emu_vibrato_deep, 1);
+	ESFM_state_u8(stream, &chip->emu_tremolo_deep, 1);
+
+	for (i = 0; i < 2; i++)
+	{
+		ESFM_state_u8(stream, &chip->timer_accumulator[i], ESFM_STATE_MAX_TIMER_ACCUMULATOR);
+		ESFM_state_u8(stream, &chip->timer_reload[i], 0xff);
+		ESFM_state_u8(stream, &chip->timer_counter[i], 0xff);
+		ESFM_state_u8(stream, &chip->timer_enable[i], 1);
+		ESFM_state_u8(stream, &chip->timer_mask[i], 1);
+		ESFM_state_u8(stream, &chip->timer_overflow[i], 1);
+	}
+	ESFM_state_u8(stream, &chip->irq_bit, 1);
+
+	ESFM_state_u8(stream, &chip->test_bit_w0_r5_eg_halt, 1);
+	ESFM_state_u8(stream, &chip->test_bit_1_distort, 1);
+	ESFM_state_u8(stream, &chip->test_bit_2, 1);
+	ESFM_state_u8(stream, &chip->test_bit_3, 1);
+	ESFM_state_u8(stream, &chip->test_bit_4_attenuate, 1);
+	ESFM_state_u8(stream, &chip->test_bit_w5_r0, 1);
+	ESFM_state_u8(stream, &chip->test_bit_6_phase_stop_reset, 1);
+	ESFM_state_u8(stream, &chip->test_bit_7, 1);
+
+	ESFM_state_u64(stream, &chip->write_buf_timestamp, UINT64_MAX);
+}
+
+/* ------------------------------------------------------------------------- */
+static size_t
+ESFM_state_fixed_size(esfm_chip *chip)
+{
+	// Everything but the header and the pending writes, which is the same
+	// for every chip
+	esfm_state_stream stream;
+
+	stream.data = NULL;
+	stream.pos = 0;
+	stream.reading = false;
+	stream.checking = false;
+	ESFM_state_chip(&stream, chip);
+	// Plus the timestamp of the last queued write
+	return stream.pos + 8;
+}
+
+/* ------------------------------------------------------------------------- */
+static size_t
+ESFM_state_pending_writes(const esfm_chip *chip)
+{
+	size_t count = 0;
+	while (count < chip->write_buf_size
+		&& chip->write_buf[(chip->write_buf_start + count) % chip->write_buf_size].valid)
+	{
+		count++;
+	}
+	return count;
+}
+
+/* ------------------------------------------------------------------------- */
+static uint64_t
+ESFM_write_buf_last_timestamp(const esfm_chip *chip)
+{
+	// ESFM_write_reg_buffered schedules new writes relative to the last
+	// queued one, even after it's been processed
+	if (chip->write_buf_size == 0)
+	{
+		return 0;
+	}
+	return chip->write_buf[(chip->write_buf_end + chip->write_buf_size - 1)
+		% chip->write_buf_size].timestamp;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_write_buf_restore(esfm_chip *chip, size_t num_pending, uint64_t last_timestamp)
+{
+	// Sets up the ring after num_pending writes have been stored at its
+	// start; every other entry has to be invalid already
+	size_t i;
+
+	chip->write_buf_start = 0;
+	chip->write_buf_end = 0;
+	if (chip->write_buf_size == 0)
+	{
+		return;
+	}
+	for (i = 0; i < num_pending; i++)
+	{
+		chip->write_buf[i].valid = 1;
+	}
+	chip->write_buf_end = num_pending % chip->write_buf_size;
+	if (num_pending == 0)
+	{
+		chip->write_buf[chip->write_buf_size - 1].timestamp = last_timestamp;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_state_load_chip(esfm_state_stream *stream, esfm_chip *chip, size_t num_pending)
+{
+	// Reads everything after the header; when only checking, nothing gets
+	// written to the chip
+	uint64_t last_timestamp = 0;
+	uint16_t address;
+	size_t i;
+
+	ESFM_state_chip(stream, chip);
+	ESFM_state_u64(stream, &last_timestamp, UINT64_MAX);
+	for (i = 0; i < num_pending; i++)
+	{
+		esfm_write_buf *entry = &chip->write_buf[i];
+		ESFM_state_u64(stream, &entry->timestamp, UINT64_MAX);
+		// Register addresses, masked as when they were queued, or port writes
+		address = (uint16_t)ESFM_state_value(stream, 0, 2);
+		if (ESFM_state_load(stream, address <= 0x7ff
+			|| (address & ~0x03) == ESFM_QUEUE_PORT_WRITE))
+		{
+			entry->address = address;
+		}
+		ESFM_state_u8(stream, &entry->data, 0xff);
+	}
+	if (!stream->checking)
+	{
+		ESFM_write_buf_restore(chip, num_pending, last_timestamp);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+size_t
+ESFM_serialized_size (const esfm_chip *chip)
+{
+	return ESFM_STATE_HEADER_SIZE + ESFM_state_fixed_size((esfm_chip *)chip)
+		+ ESFM_state_pending_writes(chip) * ESFM_STATE_WRITE_BUF_ENTRY_SIZE;
+}
+
+/* ------------------------------------------------------------------------- */
+size_t
+ESFM_serialize (const esfm_chip *chip, uint8_t *buffer, size_t buffer_size)
+{
+	// The stream only reads from the chip when saving
+	esfm_chip *source = (esfm_chip *)chip;
+	esfm_state_stream stream;
+	size_t num_pending = ESFM_state_pending_writes(chip);
+	size_t state_size = ESFM_serialized_size(chip);
+	uint64_t last_timestamp;
+	size_t i;
+
+	if (buffer == NULL || buffer_size < state_size)
+	{
+		return 0;
+	}
+
+	stream.data = buffer;
+	stream.pos = 0;
+	stream.reading = false;
+	stream.checking = false;
+	memcpy(buffer, "ESFM", 4);
+	stream.pos += 4;
+	ESFM_state_value(&stream, ESFM_STATE_VERSION, 2);
+	ESFM_state_value(&stream, num_pending, 4);
+
+	ESFM_state_chip(&stream, source);
+
+	last_timestamp = ESFM_write_buf_last_timestamp(chip);
+	ESFM_state_u64(&stream, &last_timestamp, UINT64_MAX);
+	for (i = 0; i < num_pending; i++)
+	{
+		esfm_write_buf *entry =
+			&source->write_buf[(chip->write_buf_start + i) % chip->write_buf_size];
+		ESFM_state_u64(&stream, &entry->timestamp, UINT64_MAX);
+		ESFM_state_u16(&stream, &entry->address, 0xffff);
+		ESFM_state_u8(&stream, &entry->data, 0xff);
+	}
+
+	return stream.pos;
+}
+
+/* ------------------------------------------------------------------------- */
+int
+ESFM_deserialize (esfm_chip *chip, const uint8_t *buffer, size_t buffer_size)
+{
+	esfm_state_stream stream;
+	esfm_preview preview = chip->preview;
+	size_t num_pending, state_pos;
+
+	stream.data = (uint8_t *)buffer;
+	stream.pos = 0;
+	stream.reading = true;
+	stream.checking = true;
+	stream.valid = true;
+
+	// Check everything up front, so that the chip is left untouched when
+	// the snapshot can't be loaded
+	if (buffer == NULL || buffer_size < ESFM_STATE_HEADER_SIZE
+		|| memcmp(buffer, "ESFM", 4) != 0)
+	{
+		return -1;
+	}
+	stream.pos += 4;
+	if (ESFM_state_value(&stream, 0, 2) != ESFM_STATE_VERSION)
+	{
+		return -1;
+	}
+	num_pending = (size_t)ESFM_state_value(&stream, 0, 4);
+	if (num_pending > chip->write_buf_size
+		|| buffer_size < ESFM_STATE_HEADER_SIZE + ESFM_state_fixed_size(chip)
+			+ num_pending * ESFM_STATE_WRITE_BUF_ENTRY_SIZE)
+	{
+		return -1;
+	}
+	state_pos = stream.pos;
+	ESFM_state_load_chip(&stream, chip, num_pending);
+	if (!stream.valid)
+	{
+		return -1;
+	}
+
+	// Rebuild the wiring and clear the queue, keeping the chip's own one
+	ESFM_init_with_write_buf(chip, chip->write_buf, chip->write_buf_size);
+	chip->preview = preview;
+	stream.pos = state_pos;
+	stream.checking = false;
+	ESFM_state_load_chip(&stream, chip, num_pending);
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+int
+ESFM_clone (esfm_chip *dst, const esfm_chip *src)
+{
+	esfm_write_buf *write_buf = dst->write_buf;
+	size_t write_buf_size = dst->write_buf_size;
+	esfm_preview preview = dst->preview;
+	size_t num_pending = ESFM_state_pending_writes(src);
+	uint64_t last_timestamp = ESFM_write_buf_last_timestamp(src);
+	size_t channel_idx, slot_idx, i;
+
+	if (dst == src)
+	{
+		return 0;
+	}
+	if (num_pending > write_buf_size)
+	{
+		return -1;
+	}
+
+	// Only the live entries of either queue get touched, so the cost doesn't
+	// depend on the queue size
+	for (i = ESFM_state_pending_writes(dst); i > 0; i--)
+	{
+		write_buf[(dst->write_buf_start + i - 1) % write_buf_size].valid = 0;
+	}
+
+	memcpy(dst, src, sizeof(esfm_chip));
+	dst->write_buf = write_buf;
+	dst->write_buf_size = write_buf_size;
+	dst->preview = preview;
+	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	{
+		esfm_channel *channel = &dst->channels[channel_idx];
+		const esfm_channel *src_channel = &src->channels[channel_idx];
+
+		channel->chip = dst;
+		for (slot_idx = 0; slot_idx < ESFM_CHANNEL_SLOTS; slot_idx++)
+		{
+			esfm_slot *slot = &channel->slots[slot_idx];
+			const esfm_slot *src_slot = &src_channel->slots[slot_idx];
+
+			slot->channel = channel;
+			slot->chip = dst;
+			slot->in.key_on = src_slot->in.key_on == &src_channel->key_on_2
+				? &channel->key_on_2 : &channel->key_on;
+			ESFM_slot_set_mod_source(slot, ESFM_slot_get_mod_source(src_slot));
+		}
+	}
+
+	for (i = 0; i < num_pending; i++)
+	{
+		write_buf[i] = src->write_buf[(src->write_buf_start + i) % src->write_buf_size];
+	}
+	ESFM_write_buf_restore(dst, num_pending, last_timestamp);
+
+	return 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * ESFMu: emulator for the ESS "ESFM" enhanced OPL3 clone
+ * Copyright (C) 2023 Kagamiin~
+ *
+ * ESFMu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * ESFMu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ESFMu. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Optional output resampler: converts the chip's native sample rate into an
+ * arbitrary host rate, using either linear interpolation or a Kaiser-windowed
+ * sinc filter stored as a polyphase table. Requires linking with libm.
+ */
+
+#include "esfm.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* ------------------------------------------------------------------------- */
+static double
+ESFM_bessel_i0(double x)
+{
+	// Power series; converges quickly for the beta values used here
+	double sum = 1.0, term = 1.0;
+	int k;
+	for (k = 1; k < 64; k++)
+	{
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+		if (term < sum * 1e-12)
+		{
+			break;
+		}
+	}
+	return sum;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_resampler_build_table(esfm_resampler *resampler, double cutoff, double beta)
+{
+	// Row p holds the filter taps for an output sample that lies p / PHASES
+	// of the way between the two input samples at the center of the window,
+	// with one extra row so that adjacent rows can be interpolated
+	int half_taps = (int)resampler->num_taps / 2;
+	double i0_beta = ESFM_bessel_i0(beta);
+	int phase, tap;
+
+	for (phase = 0; phase <= ESFM_RESAMPLER_PHASES; phase++)
+	{
+		float *row = &resampler->coefs[phase * ESFM_RESAMPLER_MAX_TAPS];
+		double frac = (double)phase / ESFM_RESAMPLER_PHASES;
+		double sum = 0.0;
+
+		for (tap = 0; tap < (int)resampler->num_taps; tap++)
+		{
+			double t = tap - (half_taps - 1) - frac;
+			double x = t / half_taps;
+			double sinc = t == 0.0 ? 1.0 : sin(M_PI * 2.0 * cutoff * t) / (M_PI * 2.0 * cutoff * t);
+			double window = x * x < 1.0 ? ESFM_bessel_i0(beta * sqrt(1.0 - x * x)) / i0_beta : 0.0;
+			double coef = sinc * window;
+
+			row[tap] = (float)coef;
+			sum += coef;
+		}
+		// Normalize for unity gain at DC
+		for (tap = 0; tap < (int)resampler->num_taps; tap++)
+		{
+			row[tap] = (float)(row[tap] / sum);
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+int
+ESFM_resampler_init(esfm_resampler *resampler, uint32_t out_rate, esfm_resampler_quality quality)
+{
+	double cutoff, rolloff, beta;
+
+	memset(resampler, 0, sizeof(esfm_resampler));
+	// The output position counts in 1/out_rate units, and gains a native
+	// sample's worth of them with each output sample
+	if (out_rate == 0 || out_rate > UINT32_MAX - ESFM_SAMPLE_RATE)
+	{
+		return -1;
+	}
+	resampler->out_rate = out_rate;
+	resampler->quality = quality;
+
+	switch (quality)
+	{
+		case ESFM_RESAMPLE_LINEAR:
+			resampler->num_taps = 2;
+			break;
+		case ESFM_RESAMPLE_SINC_LOW:
+			resampler->num_taps = 8;
+			rolloff = 0.80;
+			beta = 5.0;
+			break;
+		case ESFM_RESAMPLE_SINC_MEDIUM:
+			resampler->num_taps = 16;
+			rolloff = 0.88;
+			beta = 7.0;
+			break;
+		case ESFM_RESAMPLE_SINC_HIGH:
+		default:
+			resampler->quality = ESFM_RESAMPLE_SINC_HIGH;
+			resampler->num_taps = ESFM_RESAMPLER_MAX_TAPS;
+			rolloff = 0.93;
+			beta = 9.0;
+			break;
+	}
+
+	if (resampler->quality != ESFM_RESAMPLE_LINEAR)
+	{
+		// Cutoff in cycles per input sample; when downsampling, it has to be
+		// below the output Nyquist frequency to keep out aliasing
+		cutoff = 0.5 * rolloff;
+		if (out_rate < ESFM_SAMPLE_RATE)
+		{
+			cutoff *= (double)out_rate / ESFM_SAMPLE_RATE;
+		}
+		ESFM_resampler_build_table(resampler, cutoff, beta);
+	}
+
+	// Prime the window with silence, so that the first output sample lines up
+	// with the first sample generated by the chip
+	resampler->input_len = resampler->num_taps / 2 - 1;
+	return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+ESFM_resampler_fill(esfm_chip *chip, esfm_resampler *resampler, uint32_t num_samples)
+{
+	// Makes sure the input buffer holds every frame needed by the next
+	// num_samples outputs, or as many of them as fit; generating no further
+	// ahead than that keeps latency to the filter length
+	uint64_t frames_needed = resampler->input_pos + resampler->num_taps
+		+ ((uint64_t)resampler->phase_frac + (uint64_t)(num_samples - 1) * ESFM_SAMPLE_RATE)
+		/ resampler->out_rate;
+	size_t frames_free;
+	uint32_t frames_to_generate;
+
+	if (frames_needed <= resampler->input_len)
+	{
+		return;
+	}
+	if (frames_needed > ESFM_RESAMPLER_BUFFER_LEN && resampler->input_pos > 0)
+	{
+		// Not enough room left; move what's still in the window back to the
+		// start of the buffer. When downsampling, the window can step past the
+		// end of the input, over frames that then get skipped without being
+		// generated.
+		size_t frames_kept = 0;
+		if (resampler->input_pos < resampler->input_len)
+		{
+			frames_kept = resampler->input_len - resampler->input_pos;
+			memmove(resampler->input, &resampler->input[resampler->input_pos * 2],
+				frames_kept * 2 * sizeof(int16_t));
+		}
+		else
+		{
+			ESFM_skip(chip, (uint32_t)(resampler->input_pos - resampler->input_len));
+		}
+		frames_needed -= resampler->input_pos;
+		resampler->input_pos = 0;
+		resampler->input_len = frames_kept;
+	}
+	frames_free = ESFM_RESAMPLER_BUFFER_LEN - resampler->input_len;
+	frames_to_generate = (uint32_t)(frames_needed - resampler->input_len < frames_free
+		? frames_needed - resampler->input_len : frames_free);
+	ESFM_generate_stream(chip, &resampler->input[resampler->input_len * 2], frames_to_generate);
+	resampler->input_len += frames_to_generate;
+}
+
+/* ------------------------------------------------------------------------- */
+static inline int16_t
+ESFM_resampler_clip(float sample)
+{
+	if (sample >= 32767.0f)
+	{
+		return 32767;
+	}
+	else if (sample <= -32768.0f)
+	{
+		return -32768;
+	}
+	return (int16_t)lrintf(sample);
+}
+
+/* ------------------------------------------------------------------------- */
+void
+ESFM_generate_stream_resampled(esfm_chip *chip, esfm_resampler *resampler, int16_t *sndptr,
+	uint32_t num_samples)
+{
+	const uint32_t out_rate = resampler->out_rate;
+	const size_t num_taps = resampler->num_taps;
+
+	while (num_samples > 0)
+	{
+		ESFM_resampler_fill(chip, resampler, num_samples);
+
+		// Produce outputs for as long as the whole window is available
+		while (num_samples > 0 && resampler->input_pos + num_taps <= resampler->input_len)
+		{
+			const int16_t *window = &resampler->input[resampler->input_pos * 2];
+			float frac = (float)resampler->phase_frac / (float)out_rate;
+
+			if (resampler->quality == ESFM_RESAMPLE_LINEAR)
+			{
+				sndptr[0] = ESFM_resampler_clip(window[0] + (window[2] - window[0]) * frac);
+				sndptr[1] = ESFM_resampler_clip(window[1] + (window[3] - window[1]) * frac);
+			}
+			else
+			{
+				float table_pos = frac * ESFM_RESAMPLER_PHASES;
+				int phase = (int)table_pos;
+				float mu = table_pos - (float)phase;
+				const float *row0, *row1;
+				float accm_l = 0.0f, accm_r = 0.0f;
+				size_t tap;
+
+				// With output rates above 2^24, frac can round up to 1.0f;
+				// keep row1 on the last row of the table
+				if (phase >= ESFM_RESAMPLER_PHASES)
+				{
+					phase = ESFM_RESAMPLER_PHASES - 1;
+					mu = 1.0f;
+				}
+				row0 = &resampler->coefs[phase * ESFM_RESAMPLER_MAX_TAPS];
+				row1 = row0 + ESFM_RESAMPLER_MAX_TAPS;
+
+				for (tap = 0; tap < num_taps; tap++)
+				{
+					float coef = row0[tap] + (row1[tap] - row0[tap]) * mu;
+					accm_l += window[tap * 2] * coef;
+					accm_r += window[tap * 2 + 1] * coef;
+				}
+				sndptr[0] = ESFM_resampler_clip(accm_l);
+				sndptr[1] = ESFM_resampler_clip(accm_r);
+			}
+			sndptr += 2;
+			num_samples--;
+
+			resampler->phase_frac += ESFM_SAMPLE_RATE;
+			while (resampler->phase_frac >= out_rate)
+			{
+				resampler->phase_frac -= out_rate;
+				resampler->input_pos++;
+			}
+		}
+	}
+}
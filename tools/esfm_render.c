@@ -0,0 +1,411 @@
+/*
+ * ESFMu: emulator for the ESS "ESFM" enhanced OPL3 clone
+ * Copyright (C) 2023 Kagamiin~
+ *
+ * ESFMu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * ESFMu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ESFMu. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Offline renderer for register logs, in the same text format as
+ * tools/esfm_replay.c:
+ *
+ *     r ADDRESS DATA    register write
+ *     p OFFSET DATA     port write
+ *     b ADDRESS DATA    ESFM_write_reg_buffered
+ *     f ADDRESS DATA    ESFM_write_reg_buffered_fast
+ *     q OFFSET DATA     ESFM_queue_write_port
+ *     s COUNT           advance COUNT samples
+ *
+ * The log is read a line at a time and rendered in large blocks through
+ * ESFM_generate_stream_events, with the register and port writes of each
+ * block passed as events, so neither the log nor the output is ever held in
+ * memory as a whole. Buffered and queued writes go through the chip's write
+ * buffer as usual, which ends the block they fall in. Build and run it with:
+ *
+ *     cc -O2 -I. -o esfm_render tools/esfm_render.c esfm.c esfm_registers.c
+ *     ./esfm_render song.log -o song.wav
+ *
+ * The output is a 16-bit stereo WAV file at ESFM_SAMPLE_RATE, or raw
+ * little-endian PCM with -r; '-' stands for standard input or output.
+ * Without -o, the output is rendered and thrown away, to measure speed.
+ * Either way, the render speed is reported as a multiple of real time; -h
+ * also prints the same output hash as tools/esfm_replay.c.
+ */
+
+#include "esfm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define RENDER_DEFAULT_BLOCK_SIZE 16384
+#define RENDER_MAX_BLOCK_SIZE (1 << 20)
+#ifndef RENDER_MAX_EVENTS
+#define RENDER_MAX_EVENTS 65536
+#endif
+#define RENDER_WAV_HEADER_SIZE 44
+
+typedef struct _render_state
+{
+	esfm_chip_with_write_buf chip_storage;
+	esfm_chip *chip;
+	FILE *out_file;
+	int raw_output;
+	int print_hash;
+	unsigned long line_num;
+
+	// Samples of the current block so far, and the events within it
+	uint32_t block_size;
+	uint32_t block_pos;
+	esfm_reg_event events[RENDER_MAX_EVENTS];
+	uint32_t num_events;
+
+	int16_t *samples;
+	uint8_t *frames;
+	uint64_t samples_rendered;
+	uint64_t hash;
+
+} render_state;
+
+/* ------------------------------------------------------------------------- */
+static void
+render_put_le(uint8_t *dst, uint32_t value, int num_bytes)
+{
+	int i;
+	for (i = 0; i < num_bytes; i++)
+	{
+		dst[i] = (uint8_t)(value >> (i * 8));
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static int
+render_write_wav_header(FILE *out_file, uint64_t num_samples)
+{
+	// Sizes that don't fit (or aren't known yet, when writing to a pipe) are
+	// left at their maximum, which most readers take as "until the end"
+	uint8_t header[RENDER_WAV_HEADER_SIZE];
+	uint64_t data_size = num_samples * 4;
+	if (data_size > UINT32_MAX - (RENDER_WAV_HEADER_SIZE - 8))
+	{
+		data_size = UINT32_MAX - (RENDER_WAV_HEADER_SIZE - 8);
+	}
+
+	memcpy(&header[0], "RIFF", 4);
+	render_put_le(&header[4], (uint32_t)data_size + RENDER_WAV_HEADER_SIZE - 8, 4);
+	memcpy(&header[8], "WAVEfmt ", 8);
+	render_put_le(&header[16], 16, 4);
+	// PCM, 2 channels, 16 bits
+	render_put_le(&header[20], 1, 2);
+	render_put_le(&header[22], 2, 2);
+	render_put_le(&header[24], ESFM_SAMPLE_RATE, 4);
+	render_put_le(&header[28], ESFM_SAMPLE_RATE * 4, 4);
+	render_put_le(&header[32], 4, 2);
+	render_put_le(&header[34], 16, 2);
+	memcpy(&header[36], "data", 4);
+	render_put_le(&header[40], (uint32_t)data_size, 4);
+
+	return fwrite(header, 1, sizeof(header), out_file) == sizeof(header) ? 0 : -1;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+render_drop_events(render_state *state, uint32_t consumed)
+{
+	// Events that weren't consumed carry over to the start of the next block
+	uint32_t i;
+	for (i = consumed; i < state->num_events; i++)
+	{
+		esfm_reg_event *event = &state->events[i - consumed];
+		*event = state->events[i];
+		event->sample_offset = 0;
+	}
+	state->num_events -= consumed;
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+render_drain_events(render_state *state)
+{
+	// Applies events due at the start of the block without rendering
+	// anything, until there's room for more. Each call starts over with no
+	// conflicting writes noted down, so it always applies at least one; a
+	// key on deferred behind a key off in the same sample gets written
+	// right away instead, which only happens with logs writing more than
+	// RENDER_MAX_EVENTS times at the same point.
+	while (state->num_events == RENDER_MAX_EVENTS)
+	{
+		render_drop_events(state, ESFM_generate_stream_events(state->chip, NULL, 0,
+			state->events, state->num_events));
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static int
+render_flush(render_state *state)
+{
+	// Renders the current block; events it couldn't apply yet, because they
+	// were due right at its end or got deferred, carry over to the start of
+	// the next one
+	uint32_t i;
+
+	render_drop_events(state, ESFM_generate_stream_events(state->chip, state->samples,
+		state->block_pos, state->events, state->num_events));
+
+	if ((state->out_file != NULL || state->print_hash) && state->block_pos > 0)
+	{
+		size_t num_bytes = (size_t)state->block_pos * 4;
+		for (i = 0; i < state->block_pos * 2; i++)
+		{
+			render_put_le(&state->frames[i * 2], (uint16_t)state->samples[i], 2);
+		}
+		if (state->print_hash)
+		{
+			// FNV-1a over the little-endian samples, as in esfm_replay
+			for (i = 0; i < num_bytes; i++)
+			{
+				state->hash = (state->hash ^ state->frames[i]) * 0x100000001b3ull;
+			}
+		}
+		if (state->out_file != NULL && fwrite(state->frames, 1, num_bytes, state->out_file) != num_bytes)
+		{
+			fprintf(stderr, "Error writing output\n");
+			return -1;
+		}
+	}
+	state->samples_rendered += state->block_pos;
+	state->block_pos = 0;
+	return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+static int
+render_log(render_state *state, FILE *log_file)
+{
+	char line[256];
+
+	while (fgets(line, sizeof(line), log_file) != NULL)
+	{
+		char command;
+		unsigned int arg1, arg2;
+		int num_args;
+
+		state->line_num++;
+		if (line[0] == '#' || line[0] == '\n' || line[0] == '\r' || line[0] == '\0')
+		{
+			continue;
+		}
+		num_args = sscanf(line, " %c %x %x", &command, &arg1, &arg2);
+		if (num_args < 1)
+		{
+			continue;
+		}
+
+		if (command == 's' && num_args >= 2)
+		{
+			while (arg1 > 0)
+			{
+				uint32_t step = state->block_size - state->block_pos;
+				if (step > arg1)
+				{
+					step = arg1;
+				}
+				state->block_pos += step;
+				arg1 -= step;
+				if (state->block_pos == state->block_size && render_flush(state) != 0)
+				{
+					return -1;
+				}
+			}
+		}
+		else if (num_args == 3 && (command == 'r' || command == 'p'))
+		{
+			esfm_reg_event *event;
+			if (state->num_events == RENDER_MAX_EVENTS)
+			{
+				if (render_flush(state) != 0)
+				{
+					return -1;
+				}
+				render_drain_events(state);
+			}
+			event = &state->events[state->num_events++];
+			event->sample_offset = state->block_pos;
+			event->address = command == 'p'
+				? (uint16_t)(ESFM_QUEUE_PORT_WRITE | (arg1 & 0x03)) : (uint16_t)(arg1 & 0x7ff);
+			event->data = (uint8_t)arg2;
+		}
+		else if (num_args == 3 && (command == 'b' || command == 'f' || command == 'q'))
+		{
+			// The write buffer counts its delays from the sample being
+			// rendered, so everything before this write has to be rendered first
+			if (render_flush(state) != 0)
+			{
+				return -1;
+			}
+			if (command == 'b')
+			{
+				ESFM_write_reg_buffered(state->chip, (uint16_t)arg1, (uint8_t)arg2);
+			}
+			else if (command == 'f')
+			{
+				ESFM_write_reg_buffered_fast(state->chip, (uint16_t)arg1, (uint8_t)arg2);
+			}
+			else if (ESFM_queue_write_port(state->chip, (uint8_t)arg1, (uint8_t)arg2) != 0)
+			{
+				fprintf(stderr, "Write queue full on log line %lu\n", state->line_num);
+				return -1;
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Invalid command on log line %lu\n", state->line_num);
+			return -1;
+		}
+	}
+	if (ferror(log_file))
+	{
+		fprintf(stderr, "Error reading log\n");
+		return -1;
+	}
+	return render_flush(state);
+}
+
+/* ------------------------------------------------------------------------- */
+int
+main(int argc, char **argv)
+{
+	static render_state state;
+	const char *log_name = NULL, *out_name = NULL;
+	FILE *log_file;
+	clock_t start;
+	double elapsed, audio_seconds;
+	int result, i;
+
+	state.block_size = RENDER_DEFAULT_BLOCK_SIZE;
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+		{
+			out_name = argv[++i];
+		}
+		else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+		{
+			long block_size = strtol(argv[++i], NULL, 0);
+			if (block_size < 1 || block_size > RENDER_MAX_BLOCK_SIZE)
+			{
+				log_name = NULL;
+				break;
+			}
+			state.block_size = (uint32_t)block_size;
+		}
+		else if (strcmp(argv[i], "-r") == 0)
+		{
+			state.raw_output = 1;
+		}
+		else if (strcmp(argv[i], "-h") == 0)
+		{
+			state.print_hash = 1;
+		}
+		else if (log_name == NULL && (argv[i][0] != '-' || argv[i][1] == '\0'))
+		{
+			log_name = argv[i];
+		}
+		else
+		{
+			log_name = NULL;
+			break;
+		}
+	}
+	if (log_name == NULL)
+	{
+		fprintf(stderr, "usage: %s LOG [-o OUTPUT] [-r] [-h] [-b BLOCK_SIZE]\n", argv[0]);
+		return 2;
+	}
+
+	log_file = strcmp(log_name, "-") == 0 ? stdin : fopen(log_name, "r");
+	if (log_file == NULL)
+	{
+		fprintf(stderr, "Can't open %s\n", log_name);
+		return 2;
+	}
+	if (out_name != NULL)
+	{
+		state.out_file = strcmp(out_name, "-") == 0 ? stdout : fopen(out_name, "wb");
+		if (state.out_file == NULL)
+		{
+			fprintf(stderr, "Can't open %s\n", out_name);
+			fclose(log_file);
+			return 2;
+		}
+	}
+	state.samples = (int16_t *)malloc((size_t)state.block_size * 2 * sizeof(int16_t));
+	state.frames = (uint8_t *)malloc((size_t)state.block_size * 4);
+	if (state.samples == NULL || state.frames == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 2;
+	}
+
+	ESFM_init(&state.chip_storage);
+	state.chip = &state.chip_storage.chip;
+	state.hash = 0xcbf29ce484222325ull;
+	result = 0;
+	if (state.out_file != NULL && !state.raw_output
+		&& render_write_wav_header(state.out_file, UINT32_MAX) != 0)
+	{
+		fprintf(stderr, "Error writing output\n");
+		result = -1;
+	}
+	start = clock();
+	if (result == 0)
+	{
+		result = render_log(&state, log_file);
+	}
+	elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	if (result == 0 && state.out_file != NULL && !state.raw_output
+		&& fseek(state.out_file, 0, SEEK_SET) == 0
+		&& render_write_wav_header(state.out_file, state.samples_rendered) != 0)
+	{
+		fprintf(stderr, "Error writing output\n");
+		result = -1;
+	}
+	if (result == 0)
+	{
+		audio_seconds = (double)state.samples_rendered / ESFM_SAMPLE_RATE;
+		fprintf(stderr, "%llu samples (%.1f s) rendered in %.2f s, %.1fx real time\n",
+			(unsigned long long)state.samples_rendered, audio_seconds, elapsed,
+			elapsed > 0.0 ? audio_seconds / elapsed : 0.0);
+		if (state.print_hash)
+		{
+			fprintf(state.out_file == stdout ? stderr : stdout, "%llu samples, output hash %016llx\n",
+				(unsigned long long)state.samples_rendered, (unsigned long long)state.hash);
+		}
+	}
+
+	if (log_file != stdin)
+	{
+		fclose(log_file);
+	}
+	if (state.out_file != NULL && state.out_file != stdout && fclose(state.out_file) != 0)
+	{
+		fprintf(stderr, "Error writing output\n");
+		result = -1;
+	}
+	free(state.samples);
+	free(state.frames);
+	return result == 0 ? 0 : 1;
+}
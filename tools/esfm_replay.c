@@ -0,0 +1,325 @@
+/*
+ * ESFMu: emulator for the ESS "ESFM" enhanced OPL3 clone
+ * Copyright (C) 2023 Kagamiin~
+ *
+ * ESFMu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 2.1
+ * of the License, or (at your option) any later version.
+ *
+ * ESFMu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with ESFMu. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Register log player, for checking that changes to the emulator don't
+ * change its output.
+ *
+ * Replays a register log, printing a hash of the rendered output. It can
+ * also record the output of every channel and of the final mix into a
+ * reference file, or compare against one and report the first sample that
+ * differs. References are meant to be recorded with a build of the plain C
+ * code paths:
+ *
+ *     cc -O2 -I. -D_ESFMU_DISABLE_ASM_OPTIMIZATIONS -o esfm_replay_ref \
+ *         tools/esfm_replay.c esfm.c esfm_registers.c
+ *     cc -O2 -I. -o esfm_replay tools/esfm_replay.c esfm.c esfm_registers.c
+ *     ./esfm_replay_ref song.log -o song.ref
+ *     ./esfm_replay song.log -c song.ref
+ *
+ * Logs are text files with one command per line, all numbers in hex:
+ *
+ *     r ADDRESS DATA    ESFM_write_reg
+ *     b ADDRESS DATA    ESFM_write_reg_buffered
+ *     f ADDRESS DATA    ESFM_write_reg_buffered_fast
+ *     p OFFSET DATA     ESFM_write_port
+ *     q OFFSET DATA     ESFM_queue_write_port
+ *     s COUNT           render COUNT samples
+ *
+ * Blank lines and lines starting with '#' are ignored. The chip starts out
+ * in emulation mode, as after ESFM_init; logs switch modes the same way
+ * software does.
+ */
+
+#include "esfm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define REPLAY_CHUNK_SIZE 1024
+// Stereo mix followed by the stereo output of each of the 18 channels
+#define REPLAY_FRAME_VALUES (2 + 18 * 2)
+
+typedef enum _replay_mode
+{
+	REPLAY_HASH,
+	REPLAY_RECORD,
+	REPLAY_COMPARE
+} replay_mode;
+
+typedef struct _replay_state
+{
+	esfm_chip_with_write_buf chip_storage;
+	esfm_chip *chip;
+	replay_mode mode;
+	FILE *ref_file;
+	uint64_t hash;
+	uint64_t sample_pos;
+	unsigned long line_num;
+
+	int16_t mix[REPLAY_CHUNK_SIZE * 2];
+	int16_t channels[18][REPLAY_CHUNK_SIZE * 2];
+	uint8_t frames[REPLAY_CHUNK_SIZE * REPLAY_FRAME_VALUES * 2];
+	uint8_t ref_frames[REPLAY_CHUNK_SIZE * REPLAY_FRAME_VALUES * 2];
+
+} replay_state;
+
+/* ------------------------------------------------------------------------- */
+static int16_t
+replay_frame_value(const uint8_t *frames, size_t frame_idx, int value_idx)
+{
+	const uint8_t *value = &frames[(frame_idx * REPLAY_FRAME_VALUES + value_idx) * 2];
+	return (int16_t)(value[0] | (value[1] << 8));
+}
+
+/* ------------------------------------------------------------------------- */
+static void
+replay_report_mismatch(const replay_state *state, size_t frame_idx)
+{
+	// Channels first, since they show where a difference in the mix comes from
+	int value_idx;
+
+	printf("Output differs at sample %llu (log line %lu):\n",
+		(unsigned long long)(state->sample_pos + frame_idx), state->line_num);
+	for (value_idx = 2; value_idx < REPLAY_FRAME_VALUES; value_idx++)
+	{
+		int16_t got = replay_frame_value(state->frames, frame_idx, value_idx);
+		int16_t expected = replay_frame_value(state->ref_frames, frame_idx, value_idx);
+		if (got != expected)
+		{
+			printf("  channel %d %s: %d, expected %d\n", (value_idx - 2) / 2,
+				(value_idx & 1) ? "right" : "left", got, expected);
+		}
+	}
+	for (value_idx = 0; value_idx < 2; value_idx++)
+	{
+		int16_t got = replay_frame_value(state->frames, frame_idx, value_idx);
+		int16_t expected = replay_frame_value(state->ref_frames, frame_idx, value_idx);
+		if (got != expected)
+		{
+			printf("  mix %s: %d, expected %d\n", value_idx ? "right" : "left", got, expected);
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+static int
+replay_render(replay_state *state, uint32_t num_samples)
+{
+	int16_t *channel_bufs[18];
+	int channel_idx;
+
+	for (channel_idx = 0; channel_idx < 18; channel_idx++)
+	{
+		channel_bufs[channel_idx] = state->channels[channel_idx];
+	}
+
+	while (num_samples > 0)
+	{
+		uint32_t chunk = num_samples < REPLAY_CHUNK_SIZE ? num_samples : REPLAY_CHUNK_SIZE;
+		size_t chunk_bytes = (size_t)chunk * REPLAY_FRAME_VALUES * 2;
+		uint32_t i;
+
+		ESFM_generate_stream_channels(state->chip, state->mix, channel_bufs, 1, chunk);
+
+		for (i = 0; i < chunk; i++)
+		{
+			uint8_t *frame = &state->frames[i * REPLAY_FRAME_VALUES * 2];
+			int value_idx;
+
+			for (value_idx = 0; value_idx < REPLAY_FRAME_VALUES; value_idx++)
+			{
+				int16_t value = value_idx < 2 ? state->mix[i * 2 + value_idx]
+					: state->channels[(value_idx - 2) / 2][i * 2 + (value_idx & 1)];
+				frame[value_idx * 2] = (uint8_t)value;
+				frame[value_idx * 2 + 1] = (uint8_t)((uint16_t)value >> 8);
+			}
+			// FNV-1a over the mix, as little-endian 16-bit samples
+			for (value_idx = 0; value_idx < 4; value_idx++)
+			{
+				state->hash = (state->hash ^ frame[value_idx]) * 0x100000001b3ull;
+			}
+		}
+
+		if (state->mode == REPLAY_RECORD)
+		{
+			if (fwrite(state->frames, 1, chunk_bytes, state->ref_file) != chunk_bytes)
+			{
+				fprintf(stderr, "Error writing reference file\n");
+				return -1;
+			}
+		}
+		else if (state->mode == REPLAY_COMPARE)
+		{
+			size_t ref_bytes = fread(state->ref_frames, 1, chunk_bytes, state->ref_file);
+			if (memcmp(state->frames, state->ref_frames, ref_bytes) != 0)
+			{
+				for (i = 0; i < chunk; i++)
+				{
+					if (memcmp(&state->frames[i * REPLAY_FRAME_VALUES * 2],
+						&state->ref_frames[i * REPLAY_FRAME_VALUES * 2], REPLAY_FRAME_VALUES * 2) != 0)
+					{
+						break;
+					}
+				}
+				replay_report_mismatch(state, i);
+				return -1;
+			}
+			if (ref_bytes < chunk_bytes)
+			{
+				printf("Reference ends at sample %llu (log line %lu)\n",
+					(unsigned long long)(state->sample_pos + ref_bytes / (REPLAY_FRAME_VALUES * 2)),
+					state->line_num);
+				return -1;
+			}
+		}
+
+		state->sample_pos += chunk;
+		num_samples -= chunk;
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+static int
+replay_log(replay_state *state, FILE *log_file)
+{
+	char line[256];
+
+	while (fgets(line, sizeof(line), log_file) != NULL)
+	{
+		char command;
+		unsigned int arg1, arg2;
+		int num_args;
+
+		state->line_num++;
+		if (line[0] == '#' || line[0] == '\n' || line[0] == '\r' || line[0] == '\0')
+		{
+			continue;
+		}
+		num_args = sscanf(line, " %c %x %x", &command, &arg1, &arg2);
+		if (num_args < 1)
+		{
+			continue;
+		}
+
+		if (command == 's' && num_args >= 2)
+		{
+			if (replay_render(state, arg1) != 0)
+			{
+				return -1;
+			}
+		}
+		else if (num_args == 3 && (command == 'r' || command == 'b' || command == 'f'
+			|| command == 'p' || command == 'q'))
+		{
+			switch (command)
+			{
+			case 'r':
+				ESFM_write_reg(state->chip, (uint16_t)arg1, (uint8_t)arg2);
+				break;
+			case 'b':
+				ESFM_write_reg_buffered(state->chip, (uint16_t)arg1, (uint8_t)arg2);
+				break;
+			case 'f':
+				ESFM_write_reg_buffered_fast(state->chip, (uint16_t)arg1, (uint8_t)arg2);
+				break;
+			case 'p':
+				ESFM_write_port(state->chip, (uint8_t)arg1, (uint8_t)arg2);
+				break;
+			case 'q':
+				if (ESFM_queue_write_port(state->chip, (uint8_t)arg1, (uint8_t)arg2) != 0)
+				{
+					fprintf(stderr, "Write queue full on log line %lu\n", state->line_num);
+					return -1;
+				}
+				break;
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Invalid command on log line %lu\n", state->line_num);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+int
+main(int argc, char **argv)
+{
+	static replay_state state;
+	FILE *log_file;
+	int result;
+
+	if (argc != 2 && !(argc == 4 && (strcmp(argv[2], "-o") == 0 || strcmp(argv[2], "-c") == 0)))
+	{
+		fprintf(stderr, "usage: %s LOG [-o REFERENCE | -c REFERENCE]\n", argv[0]);
+		return 2;
+	}
+
+	log_file = fopen(argv[1], "r");
+	if (log_file == NULL)
+	{
+		fprintf(stderr, "Can't open %s\n", argv[1]);
+		return 2;
+	}
+	state.mode = REPLAY_HASH;
+	if (argc == 4)
+	{
+		state.mode = argv[2][1] == 'o' ? REPLAY_RECORD : REPLAY_COMPARE;
+		state.ref_file = fopen(argv[3], state.mode == REPLAY_RECORD ? "wb" : "rb");
+		if (state.ref_file == NULL)
+		{
+			fprintf(stderr, "Can't open %s\n", argv[3]);
+			fclose(log_file);
+			return 2;
+		}
+	}
+
+	ESFM_init(&state.chip_storage);
+	state.chip = &state.chip_storage.chip;
+	state.hash = 0xcbf29ce484222325ull;
+	result = replay_log(&state, log_file);
+
+	if (result == 0 && state.mode == REPLAY_COMPARE && fgetc(state.ref_file) != EOF)
+	{
+		printf("Reference continues past the end of the log, at sample %llu\n",
+			(unsigned long long)state.sample_pos);
+		result = -1;
+	}
+	if (result == 0)
+	{
+		printf("%llu samples, output hash %016llx\n", (unsigned long long)state.sample_pos,
+			(unsigned long long)state.hash);
+		if (state.mode == REPLAY_COMPARE)
+		{
+			printf("Output matches the reference\n");
+		}
+	}
+
+	fclose(log_file);
+	if (state.ref_file != NULL && fclose(state.ref_file) != 0 && state.mode == REPLAY_RECORD)
+	{
+		fprintf(stderr, "Error writing reference file\n");
+		result = -1;
+	}
+	return result == 0 ? 0 : 1;
+}